@@ -1,44 +1,48 @@
 /*******************************************************************************
-** OTP: key generator 
-** Description: The keygen program produces a key of a specified length from the 
-		command line argument. The key can contain random uppercase 
-		letters and a space character. Each character is printed to
-		stdout, one by one until end of key length where a newline 
-		completes the key.
+** OTP: key generator
+** Description: The keygen program produces a key of a specified length from the
+		command line argument. The key is drawn from the alphabet
+		chosen with -a, by default random uppercase letters and a
+		space character. Each character is printed to stdout, one by
+		one until end of key length where a newline completes the key.
 *******************************************************************************/
+#define _POSIX_C_SOURCE 200809L
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
 #include <time.h>
+#include "otp_alphabet.h"
 
-int main(int argc, char *argv[]) {	
-   // Check at least 2 arguments were passed from command line
-   if (argc < 2) {
+int main(int argc, char *argv[]) {
+   int option;
+   const struct alphabet* alphabet = findAlphabet(DEFAULTALPHABET);
+
+   // Optional -a picks the alphabet the key is drawn from
+   while ((option = getopt(argc, argv, "a:")) != -1) {
+	if (option != 'a' || (alphabet = findAlphabet(optarg)) == NULL) {
+		fprintf(stderr, "Unknown alphabet!");
+		exit(0);
+	}
+   }
+
+   // Check the key length was passed from command line
+   if (optind >= argc) {
 	fprintf(stderr, "Too few arguments!");  // Print error message to stderr
 	exit(0);  // Terminate program successfully
    }
- 
+
    srand(time(NULL));  // Seed random number generator
-   char capLetter;  //  The random capital letter generated or space
-	
-   // Convert C-string to integer	
-   int keyLength = atoi(argv[1]);  // keyLength specified from argument 1 on command line
+
+   // Convert C-string to integer
+   int keyLength = atoi(argv[optind]);  // keyLength specified from argument 1 on command line
 
    for (int i = 0; i < keyLength; i++) {
-   	// Generate random capital letters A - Z using ASCII
-	// Uppercase alphabet is 65 - 90.  See below for 91
-	capLetter = 0;  // initialize and reset
-	capLetter = 65 + (rand() % 27 );
-		
-	// Substitute ASCII decimal 91 with space character 32
-	if (capLetter == 91) {
-		capLetter = 32;
-	}
-		
-	printf("%c", capLetter);  // Print character to stdout
+	// Random symbol from the alphabet table
+	printf("%c", alphabet->symbols[rand() % alphabet->size]);  // Print character to stdout
    }
 
-   printf("\n"); 
+   printf("\n");
 
    return 0;
 }
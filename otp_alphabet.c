@@ -0,0 +1,82 @@
+/*******************************************************************************
+** Description: Cipher kernels, generated once per alphabet in OTP_ALPHABETS.
+**              Each kernel maps bytes to symbol indexes through a 256-entry
+**              table. Since both indexes are below the alphabet size, the
+**              modulus reduces to one compare and subtract against a
+**              constant. The index tables are filled on the first lookup.
+*******************************************************************************/
+#include <string.h>
+#include <stdbool.h>
+#include "otp_alphabet.h"
+
+#define NOTASYMBOL 0xFF
+
+#define DEFINE_KERNELS(name, symbolList, symbolCount) \
+   typedef char name##SizeCheck[(sizeof(symbolList) - 1 == (symbolCount)) ? 1 : -1]; \
+   static const char name##Symbols[] = symbolList; \
+   static unsigned char name##Index[256]; \
+   \
+   static void name##Encode(char* out, const char* msg, const char* key, size_t length) { \
+	for (size_t i = 0; i < length; i++) { \
+		unsigned sum = name##Index[(unsigned char)msg[i]] + name##Index[(unsigned char)key[i]]; \
+		out[i] = name##Symbols[sum >= (symbolCount) ? sum - (symbolCount) : sum]; \
+	} \
+   } \
+   \
+   static void name##Decode(char* out, const char* msg, const char* key, size_t length) { \
+	for (size_t i = 0; i < length; i++) { \
+		int difference = name##Index[(unsigned char)msg[i]] - name##Index[(unsigned char)key[i]]; \
+		out[i] = name##Symbols[difference < 0 ? difference + (symbolCount) : difference]; \
+	} \
+   } \
+   \
+   static size_t name##Validate(const char* text, size_t length) { \
+	for (size_t i = 0; i < length; i++) { \
+		if (name##Index[(unsigned char)text[i]] == NOTASYMBOL) { \
+			return i; \
+		} \
+	} \
+	return length; \
+   }
+
+OTP_ALPHABETS(DEFINE_KERNELS)
+
+#define ALPHABET_ENTRY(name, symbolList, symbolCount) \
+   { #name, name##Symbols, (symbolCount), name##Encode, name##Decode, name##Validate },
+
+static const struct alphabet alphabets[] = {
+   OTP_ALPHABETS(ALPHABET_ENTRY)
+};
+
+#define FILL_INDEX(name, symbolList, symbolCount) \
+   memset(name##Index, NOTASYMBOL, sizeof(name##Index)); \
+   for (int i = 0; i < (symbolCount); i++) { \
+	name##Index[(unsigned char)name##Symbols[i]] = i; \
+   }
+
+const struct alphabet* findAlphabet(const char* name) {
+   static bool indexesFilled = false;
+
+   if (!indexesFilled) {
+	OTP_ALPHABETS(FILL_INDEX)
+	indexesFilled = true;
+   }
+
+   for (size_t i = 0; i < sizeof(alphabets) / sizeof(alphabets[0]); i++) {
+	if (strcmp(alphabets[i].name, name) == 0) {
+		return &alphabets[i];
+	}
+   }
+   return NULL;
+}
+
+int alphabetIndex(const struct alphabet* alphabet) {
+   return alphabet - alphabets;
+}
+
+const struct alphabet* alphabetAt(int index) {
+   if (index < 0 || index >= (int)(sizeof(alphabets) / sizeof(alphabets[0]))) {
+	return NULL;
+   }
+   return findAlphabet(alphabets[index].name);  // Fills the index tables on first use
+}
@@ -0,0 +1,42 @@
+/*******************************************************************************
+** Description: Character sets the one-time pad works over. Each alphabet is
+**              listed once in OTP_ALPHABETS. otp_alphabet.c expands that list
+**              into encode, decode, and validate kernels with the alphabet
+**              size as a compile-time constant, so adding an alphabet is one
+**              line here and costs nothing at run time.
+*******************************************************************************/
+#ifndef OTP_ALPHABET_H
+#define OTP_ALPHABET_H
+
+#include <stddef.h>
+
+// name, symbols in index order, number of symbols
+#define OTP_ALPHABETS(X) \
+   X(caps, "ABCDEFGHIJKLMNOPQRSTUVWXYZ ", 27) \
+   X(printable, " !\"#$%&'()*+,-./0123456789:;<=>?@ABCDEFGHIJKLMNOPQRSTUVWXYZ[\\]^_`abcdefghijklmnopqrstuvwxyz{|}~", 95) \
+   X(base64, "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/", 64)
+
+#define DEFAULTALPHABET "caps"
+
+typedef void (*cipherKernel)(char* out, const char* msg, const char* key, size_t length);
+
+struct alphabet {
+   const char* name;
+   const char* symbols;
+   int size;
+   // out[i] = symbol of (msg[i] + key[i]) mod size
+   cipherKernel encode;
+   // out[i] = symbol of (msg[i] - key[i]) mod size
+   cipherKernel decode;
+   // Index of the first byte not in the alphabet, or length if all are valid
+   size_t (*validate)(const char* text, size_t length);
+};
+
+// Alphabet with this name, or NULL if there is none
+const struct alphabet* findAlphabet(const char* name);
+
+// Position in OTP_ALPHABETS, and the alphabet at a position or NULL
+int alphabetIndex(const struct alphabet* alphabet);
+const struct alphabet* alphabetAt(int index);
+
+#endif
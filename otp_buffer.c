@@ -0,0 +1,96 @@
+/*******************************************************************************
+** Description: Buffer pool implementation. Each size class keeps a short free
+**              list of buffers; anything past POOLDEPTH is handed back to
+**              malloc so one huge message doesn't pin its memory forever.
+**              Buffers above the largest class never enter a free list.
+*******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "otp_buffer.h"
+
+void error(const char *msg);  // Supplied by each program
+
+static struct otpBuffer* freeLists[NUMCLASSES];
+static int freeCounts[NUMCLASSES];
+
+// Smallest size class that holds capacity bytes, UNPOOLED past the largest
+static int sizeClassFor(size_t capacity) {
+   int sizeClass = 0;
+   while (sizeClass < NUMCLASSES && ((size_t)1 << (sizeClass + MINCLASSSHIFT)) < capacity) {
+	sizeClass++;
+   }
+   return sizeClass < NUMCLASSES ? sizeClass : UNPOOLED;
+}
+
+struct otpBuffer* acquireBuffer(size_t capacity) {
+   int sizeClass = sizeClassFor(capacity);
+   struct otpBuffer* buffer = sizeClass != UNPOOLED ? freeLists[sizeClass] : NULL;
+
+   // Reuse a pooled buffer if one is free
+   if (buffer != NULL) {
+	freeLists[sizeClass] = buffer->next;
+	freeCounts[sizeClass]--;
+   }
+   else {
+	buffer = malloc(sizeof(struct otpBuffer));
+	if (buffer == NULL) error("ERROR allocating buffer");
+	buffer->capacity = sizeClass != UNPOOLED ? (size_t)1 << (sizeClass + MINCLASSSHIFT) : capacity;
+	buffer->data = malloc(buffer->capacity);
+	if (buffer->data == NULL) error("ERROR allocating buffer");
+	buffer->sizeClass = sizeClass;
+   }
+
+   buffer->length = 0;
+   buffer->next = NULL;
+   return buffer;
+}
+
+void reserveBuffer(struct otpBuffer* buffer, size_t extra) {
+   if (buffer->length + extra <= buffer->capacity) {
+	return;
+   }
+
+   // Move contents into a larger class, then swap storage so the caller's pointer stays valid.
+   // Past the classes, at least double, so growing by appends stays linear.
+   size_t needed = buffer->length + extra;
+   if (needed > ((size_t)1 << (NUMCLASSES - 1 + MINCLASSSHIFT)) && needed < 2 * buffer->capacity) needed = 2 * buffer->capacity;
+   struct otpBuffer* larger = acquireBuffer(needed);
+   memcpy(larger->data, buffer->data, buffer->length);
+
+   char* oldData = buffer->data;
+   size_t oldCapacity = buffer->capacity;
+   int oldClass = buffer->sizeClass;
+
+   buffer->data = larger->data;
+   buffer->capacity = larger->capacity;
+   buffer->sizeClass = larger->sizeClass;
+
+   larger->data = oldData;
+   larger->capacity = oldCapacity;
+   larger->sizeClass = oldClass;
+   releaseBuffer(larger);
+}
+
+void appendBuffer(struct otpBuffer* buffer, const char* bytes, size_t count) {
+   reserveBuffer(buffer, count);
+   memcpy(buffer->data + buffer->length, bytes, count);
+   buffer->length += count;
+}
+
+void releaseBuffer(struct otpBuffer* buffer) {
+   if (buffer == NULL) {
+	return;
+   }
+
+   // Sized exactly, or the pool is full for this class, give the memory back
+   if (buffer->sizeClass == UNPOOLED || freeCounts[buffer->sizeClass] >= POOLDEPTH) {
+	free(buffer->data);
+	free(buffer);
+	return;
+   }
+
+   buffer->next = freeLists[buffer->sizeClass];
+   freeLists[buffer->sizeClass] = buffer;
+   freeCounts[buffer->sizeClass]++;
+}
@@ -0,0 +1,44 @@
+/*******************************************************************************
+** Description: Size-classed buffer pool shared by the otp programs. Buffers
+**              up to 1 MB are handed out in power-of-two size classes and go
+**              back on a per-process free list when released. Larger ones
+**              are allocated at the size asked for and freed on release, so
+**              a big message costs its own size and no more. The pool lives
+**              and dies with its process. A daemon child serves one
+**              connection and exits, so its buffers are reused only within
+**              that connection, such as a transfer's runs or the output
+**              quanta, never from one connection to the next. Every buffer
+**              tracks its own write offset, so appending is O(1) and nothing
+**              is ever zeroed.
+*******************************************************************************/
+#ifndef OTP_BUFFER_H
+#define OTP_BUFFER_H
+
+#include <stddef.h>
+
+#define MINCLASSSHIFT 10  // Smallest size class is 1 KB
+#define NUMCLASSES 11     // Largest size class is 1 MB
+#define POOLDEPTH 4       // Free buffers kept per size class
+#define UNPOOLED -1       // Size class of a buffer sized exactly
+
+struct otpBuffer {
+   char* data;               // Storage, never zeroed
+   size_t length;            // Bytes in use, the write offset for appends
+   size_t capacity;          // Bytes available in data
+   int sizeClass;            // Free list this storage returns to, or UNPOOLED
+   struct otpBuffer* next;   // Free list link while the buffer is pooled
+};
+
+// Get a buffer with room for at least capacity bytes and a length of zero
+struct otpBuffer* acquireBuffer(size_t capacity);
+
+// Make room for extra more bytes past the current length
+void reserveBuffer(struct otpBuffer* buffer, size_t extra);
+
+// Copy count bytes onto the end of the buffer
+void appendBuffer(struct otpBuffer* buffer, const char* bytes, size_t count);
+
+// Return a buffer to the pool
+void releaseBuffer(struct otpBuffer* buffer);
+
+#endif
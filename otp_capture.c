@@ -0,0 +1,135 @@
+/*******************************************************************************
+** Description: Request capture implementation. The supervisor opens the log
+**              and maps one record per connection slot, shared with every
+**              child. It stamps a slot's record just before it forks, and
+**              the child fills in the rest and appends it from an exit
+**              handler. A child killed before that leaves its record in the
+**              mapping, and the supervisor appends it when reaping. Records
+**              are far below PIPE_BUF and the log is opened with O_APPEND,
+**              so processes writing at once never interleave.
+*******************************************************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "otp_capture.h"
+#include "otp_connection.h"
+#include "otp_keycache.h"
+
+void error(const char *msg);  // Supplied by each program
+
+#define TAGSECRETSIZE 16
+
+struct captureSlot {
+   struct captureRecord record;
+   volatile bool written;         // The child appended it, the supervisor must not
+};
+
+static int captureFD = -1;
+static pid_t supervisorPid;
+static uint64_t captureStarted;
+static char tagSecret[TAGSECRETSIZE];
+static struct captureSlot* captureSlots;   // One per connection slot, shared
+static struct captureSlot* current;        // Set in a child to its own
+
+static uint64_t clockUs(clockid_t clock) {
+   struct timespec now;
+   clock_gettime(clock, &now);
+   return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static void appendRecord(struct captureSlot* slot) {
+   slot->record.duration = clockUs(CLOCK_MONOTONIC) - captureStarted - slot->record.accepted;
+   if (write(captureFD, &slot->record, sizeof(slot->record)) < 0) perror("ERROR writing capture");
+   slot->written = true;
+}
+
+// Exit handler, only children have a record to write
+static void writeRecord(void) {
+   if (getpid() == supervisorPid || current == NULL) return;
+   appendRecord(current);
+}
+
+void openCapture(const char* path) {
+   struct captureHeader header;
+
+   // The secret only has to differ between captures and stay unknown, it is never written
+   int randomFD = open("/dev/urandom", O_RDONLY);
+   if (randomFD < 0 || read(randomFD, tagSecret, sizeof(tagSecret)) != sizeof(tagSecret)) error("ERROR reading /dev/urandom");
+   close(randomFD);
+
+   captureSlots = mmap(NULL, MAXCONNECTIONS * sizeof(struct captureSlot), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+   if (captureSlots == MAP_FAILED) error("ERROR mapping capture records");
+
+   captureFD = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+   if (captureFD < 0) error("ERROR opening capture");
+
+   memset(&header, '\0', sizeof(header));
+   memcpy(header.magic, CAPTUREMAGIC, sizeof(header.magic));
+   header.recordSize = sizeof(struct captureRecord);
+   header.startedUnixUs = clockUs(CLOCK_REALTIME);
+   if (write(captureFD, &header, sizeof(header)) != sizeof(header)) error("ERROR writing capture");
+
+   supervisorPid = getpid();
+   captureStarted = clockUs(CLOCK_MONOTONIC);
+   if (atexit(writeRecord) != 0) error("ERROR registering capture");
+}
+
+void captureAccepted(int slot, uint32_t connection) {
+   if (captureFD < 0) return;
+
+   current = &captureSlots[slot];  // Only the child forked next keeps using it
+   memset(current, '\0', sizeof(*current));
+   current->record.accepted = clockUs(CLOCK_MONOTONIC) - captureStarted;
+   current->record.connection = connection;
+}
+
+void captureKilled(int slot) {
+   if (captureFD < 0 || captureSlots[slot].written) return;
+
+   captureSlots[slot].record.flags |= CAPTUREKILLED;
+   appendRecord(&captureSlots[slot]);
+}
+
+void captureFirstRequest(void) {
+   if (captureFD < 0) return;
+   current->record.firstRequest = clockUs(CLOCK_MONOTONIC) - captureStarted - current->record.accepted;
+}
+
+void captureRejected(void) {
+   if (captureFD < 0) return;
+   current->record.flags |= CAPTUREREJECTED;
+}
+
+void captureRequest(int opcode, const struct alphabet* alphabet, size_t messageLength) {
+   if (captureFD < 0) return;
+   current->record.opcode = opcode;
+   current->record.alphabet = alphabetIndex(alphabet);
+   current->record.messageLength = messageLength;
+}
+
+void captureKey(uint64_t digest, size_t length, int hit) {
+   char tagInput[TAGSECRETSIZE + sizeof(digest)];
+
+   if (captureFD < 0) return;
+   memcpy(tagInput, tagSecret, TAGSECRETSIZE);
+   memcpy(tagInput + TAGSECRETSIZE, &digest, sizeof(digest));
+   current->record.keyTag = (uint32_t)keyDigest(tagInput, sizeof(tagInput));
+   current->record.keyLength = length;
+   if (hit) current->record.flags |= CAPTUREKEYHIT;
+}
+
+void captureTransfer(void) {
+   if (captureFD < 0) return;
+   current->record.flags |= CAPTURETRANSFER;
+}
+
+void captureComplete(void) {
+   if (captureFD < 0) return;
+   current->record.flags |= CAPTURECOMPLETE;
+}
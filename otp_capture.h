@@ -0,0 +1,78 @@
+/*******************************************************************************
+** Description: Request capture for performance testing. With -T the daemon
+**              writes one fixed-size record per connection to a binary log.
+**              A record holds when the connection arrived, how long it took,
+**              the request's opcode, alphabet, and sizes, and whether the key
+**              was already cached. Message and key contents are never
+**              written. A short tag lets a replay repeat the same keys in the
+**              same order, so the key cache sees the same reuse. The tag is
+**              hashed from the key digest and a random secret drawn for each
+**              capture and never written, so it matches equal keys within one
+**              capture but cannot be used to test guesses at a key.
+**              otp_replay reads the log back. The record is written when the
+**              child exits. A child killed by a deadline or a signal cannot
+**              write it, so the supervisor writes it when reaping the child,
+**              with what the child had filled in and CAPTUREKILLED set. The
+**              calls do nothing when no capture is open, which is always the
+**              case in the clients.
+*******************************************************************************/
+#ifndef OTP_CAPTURE_H
+#define OTP_CAPTURE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "otp_alphabet.h"
+
+#define CAPTUREMAGIC "OTPCAP1"    // Eight bytes with the terminator
+
+#define CAPTURENONE 0             // Connection closed before a request
+#define CAPTUREENCRYPT 1
+#define CAPTUREDECRYPT 2
+
+#define CAPTUREKEYHIT 0x01        // Key came from the daemon's cache
+#define CAPTUREREJECTED 0x02      // Token was refused
+#define CAPTURECOMPLETE 0x04      // Reply was sent in full
+#define CAPTUREKILLED 0x08        // Child was killed, the supervisor wrote the record
+#define CAPTURETRANSFER 0x10      // Resumable transfer, messageLength is the whole text
+
+struct captureHeader {
+   char magic[8];
+   uint32_t recordSize;
+   uint32_t reserved;
+   uint64_t startedUnixUs;        // Wall clock when the capture began
+};
+
+// Host byte order, times in microseconds
+struct captureRecord {
+   uint64_t accepted;             // Since the capture began
+   uint64_t messageLength;
+   uint64_t keyLength;
+   uint32_t firstRequest;         // From accept to the first byte of the request
+   uint32_t duration;             // From accept to the child's exit
+   uint32_t connection;           // Serial, unique within a capture
+   uint32_t keyTag;               // Key digest hashed with the capture's secret
+   uint8_t opcode;
+   uint8_t alphabet;              // Index in OTP_ALPHABETS
+   uint8_t flags;
+   uint8_t request;               // Index of the request on its connection
+   uint32_t reserved;
+};
+
+// Supervisor: start a new capture at path, replacing any file there
+void openCapture(const char* path);
+
+// Supervisor, just before forking the child for the connection in this table slot
+void captureAccepted(int slot, uint32_t connection);
+
+// Supervisor, on reaping a child that was killed, before its slot is reused
+void captureKilled(int slot);
+
+// Child side, filled in as the connection goes along
+void captureFirstRequest(void);
+void captureRejected(void);
+void captureRequest(int opcode, const struct alphabet* alphabet, size_t messageLength);
+void captureKey(uint64_t digest, size_t length, int hit);
+void captureTransfer(void);
+void captureComplete(void);
+
+#endif
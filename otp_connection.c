@@ -0,0 +1,80 @@
+/*******************************************************************************
+** Description: Connection table implementation. The table is an anonymous
+**              shared mapping. Children only write their own slot's stamps,
+**              and the supervisor only reads them, so no lock is needed.
+*******************************************************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "otp_connection.h"
+
+void error(const char *msg);  // Supplied by each program
+
+struct connectionSlot* connectionTable = NULL;
+struct connectionSlot* currentConnection = NULL;
+uint32_t currentSerial = 0;
+
+uint64_t monotonicMs(void) {
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+void createConnectionTable(void) {
+   connectionTable = mmap(NULL, MAXCONNECTIONS * sizeof(struct connectionSlot), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+   if (connectionTable == MAP_FAILED) error("ERROR mapping connection table");
+   memset(connectionTable, '\0', MAXCONNECTIONS * sizeof(struct connectionSlot));
+}
+
+struct connectionSlot* claimConnectionSlot(void) {
+   static uint32_t nextSerial = 1;
+
+   for (int i = 0; i < MAXCONNECTIONS; i++) {
+	if (connectionTable[i].pid == 0) {
+		connectionTable[i].serial = nextSerial++;
+		connectionTable[i].phase = PHASEHANDSHAKE;
+		connectionTable[i].phaseStarted = monotonicMs();
+		connectionTable[i].lastActivity = connectionTable[i].phaseStarted;
+		return &connectionTable[i];
+	}
+   }
+   return NULL;
+}
+
+struct connectionSlot* findConnectionSlot(pid_t pid) {
+   for (int i = 0; i < MAXCONNECTIONS; i++) {
+	if (connectionTable[i].pid == pid) {
+		return &connectionTable[i];
+	}
+   }
+   return NULL;
+}
+
+int openConnections(void) {
+   int open = 0;
+   for (int i = 0; i < MAXCONNECTIONS; i++) {
+	if (connectionTable[i].pid != 0) {
+		open++;
+	}
+   }
+   return open;
+}
+
+void beginPhase(int phase) {
+   if (currentConnection == NULL) {
+	return;
+   }
+   uint64_t now = monotonicMs();
+   currentConnection->phaseStarted = now;
+   currentConnection->lastActivity = now;
+   currentConnection->phase = phase;
+}
+
+void markActivity(void) {
+   if (currentConnection != NULL) {
+	currentConnection->lastActivity = monotonicMs();
+   }
+}
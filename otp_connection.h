@@ -0,0 +1,57 @@
+/*******************************************************************************
+** Description: Connection table shared between the daemon supervisor and its
+**              children. Each child records the phase it is in and when it
+**              last moved a byte. The supervisor reads those stamps when a
+**              connection's timer fires, to decide whether the peer has
+**              missed a deadline. Clients link this too, and with no table
+**              mapped the calls do nothing.
+*******************************************************************************/
+#ifndef OTP_CONNECTION_H
+#define OTP_CONNECTION_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "otp_timer.h"
+
+#define MAXCONNECTIONS 128
+
+#define PHASEHANDSHAKE 0  // Accepted, token not yet verified
+#define PHASEIDLE 1       // Between messages
+#define PHASEMESSAGE 2    // A message is being sent or received
+#define PHASEWORK 3       // Ciphering, no network deadline applies
+
+struct connectionSlot {
+   struct timer timer;               // First member, supervisor only
+   volatile pid_t pid;               // Child serving the connection, 0 when free
+   uint32_t serial;                  // Connection id, unique for the daemon's life
+   uint32_t clientAddress;           // Peer IPv4 address, network order
+   uint64_t client;                  // Scheduler identity, see otp_sched.h
+   int cpu;                          // Worker CPU the child is placed on, -1 without -A
+   volatile int phase;
+   volatile uint64_t phaseStarted;   // Milliseconds on the monotonic clock
+   volatile uint64_t lastActivity;
+};
+
+extern struct connectionSlot* connectionTable;
+extern struct connectionSlot* currentConnection;  // Set in a child to its own slot
+extern uint32_t currentSerial;                    // Its serial, read by every probe, 0 outside a daemon child
+
+uint64_t monotonicMs(void);
+
+// Map the table before forking, all slots free
+void createConnectionTable(void);
+
+// Free slot for a new connection, or NULL when the table is full
+struct connectionSlot* claimConnectionSlot(void);
+
+// Slot belonging to a child, or NULL
+struct connectionSlot* findConnectionSlot(pid_t pid);
+
+// Slots in use
+int openConnections(void);
+
+// Child side, record a phase change or progress on the socket
+void beginPhase(int phase);
+void markActivity(void);
+
+#endif
@@ -0,0 +1,88 @@
+/*******************************************************************************
+** Description: CRC32C implementation. The choice between the instruction and
+**              the table is made on the first call and kept. The table is
+**              only built if it is needed.
+*******************************************************************************/
+#include <string.h>
+#include "otp_crc32c.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define OTP_CRC32C_HARDWARE
+#endif
+
+#define CASTAGNOLI 0x82F63B78  // Reflected polynomial
+
+static uint32_t table[8][256];
+
+static void buildTable(void) {
+   for (uint32_t i = 0; i < 256; i++) {
+	uint32_t crc = i;
+	for (int bit = 0; bit < 8; bit++) {
+		crc = (crc >> 1) ^ (crc & 1 ? CASTAGNOLI : 0);
+	}
+	table[0][i] = crc;
+   }
+   for (int slice = 1; slice < 8; slice++) {
+	for (int i = 0; i < 256; i++) {
+		table[slice][i] = (table[slice - 1][i] >> 8) ^ table[0][table[slice - 1][i] & 0xFF];
+	}
+   }
+}
+
+// crc is already inverted
+static uint32_t crc32cTable(uint32_t crc, const unsigned char* bytes, size_t length) {
+   while (length >= 8) {
+	uint32_t low, high;
+	memcpy(&low, bytes, 4);
+	memcpy(&high, bytes + 4, 4);
+	low ^= crc;  // Little-endian order, as on every target this runs on
+	crc = table[7][low & 0xFF] ^ table[6][(low >> 8) & 0xFF] ^ table[5][(low >> 16) & 0xFF] ^ table[4][low >> 24] ^
+	      table[3][high & 0xFF] ^ table[2][(high >> 8) & 0xFF] ^ table[1][(high >> 16) & 0xFF] ^ table[0][high >> 24];
+	bytes += 8;
+	length -= 8;
+   }
+   while (length-- > 0) {
+	crc = (crc >> 8) ^ table[0][(crc ^ *bytes++) & 0xFF];
+   }
+   return crc;
+}
+
+#ifdef OTP_CRC32C_HARDWARE
+__attribute__((target("sse4.2")))
+static uint32_t crc32cHardware(uint32_t crc, const unsigned char* bytes, size_t length) {
+#if defined(__x86_64__)
+   uint64_t wide = crc;
+   while (length >= 8) {
+	uint64_t word;
+	memcpy(&word, bytes, 8);
+	wide = _mm_crc32_u64(wide, word);
+	bytes += 8;
+	length -= 8;
+   }
+   crc = (uint32_t)wide;
+#endif
+   while (length-- > 0) {
+	crc = _mm_crc32_u8(crc, *bytes++);
+   }
+   return crc;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const void* data, size_t length) {
+   static int hardware = -1;
+
+   if (hardware < 0) {
+#ifdef OTP_CRC32C_HARDWARE
+	hardware = __builtin_cpu_supports("sse4.2");
+#else
+	hardware = 0;
+#endif
+	if (!hardware) buildTable();
+   }
+
+#ifdef OTP_CRC32C_HARDWARE
+   if (hardware) return ~crc32cHardware(~crc, data, length);
+#endif
+   return ~crc32cTable(~crc, data, length);
+}
@@ -0,0 +1,17 @@
+/*******************************************************************************
+** Description: CRC32C (Castagnoli) for checked message chunks. On x86 CPUs
+**              with SSE4.2 it uses the crc32 instruction, eight bytes at a
+**              time. Everywhere else it falls back to a slicing-by-8 table.
+**              Both give the same result, so the two ends of a connection
+**              need not agree on which one they run.
+*******************************************************************************/
+#ifndef OTP_CRC32C_H
+#define OTP_CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// CRC32C of data continuing from crc, 0 to start
+uint32_t crc32c(uint32_t crc, const void* data, size_t length);
+
+#endif
@@ -0,0 +1,376 @@
+/*******************************************************************************
+** Description: Daemon supervisor. The main loop polls the listener with a
+**              one-tick timeout, so it also reaps exited children and
+**              advances the timer wheel on every pass. A connection's timer
+**              is armed for the earliest of its pending deadlines. When it
+**              fires, the supervisor rereads the child's stamps and either
+**              re-arms the timer or kills the child, so each expiry costs
+**              O(1).
+*******************************************************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "otp_daemon.h"
+#include "otp_connection.h"
+#include "otp_timer.h"
+#include "otp_sched.h"
+#include "otp_buffer.h"
+#include "otp_message.h"
+#include "otp_capture.h"
+#include "otp_handoff.h"
+#include "otp_probes.h"
+#include "otp_topology.h"
+#include "otp_spool.h"
+
+void error(const char *msg);  // Supplied by each program
+
+static struct timerWheel wheel;
+static uint64_t handshakeMs = DEFAULTHANDSHAKESECS * 1000;
+static uint64_t messageMs = DEFAULTMESSAGESECS * 1000;
+static uint64_t idleMs = DEFAULTIDLESECS * 1000;
+static int listenSocketFD = -1;
+static int handoffSocketFD = -1;
+static bool placement = false;
+static struct keyCache* keyCache;
+
+static int createListener(int portNumber) {
+   struct sockaddr_in serverAddress;
+
+   // Set up the address struct for the server
+   memset((char *)&serverAddress, '\0', sizeof(serverAddress)); // Clear out the address struct
+   serverAddress.sin_family = AF_INET; // Create a network-capable socket
+   serverAddress.sin_port = htons(portNumber); // Store the port number
+   serverAddress.sin_addr.s_addr = INADDR_ANY; // Any address is allowed for connection to this process
+
+   // Set up the socket
+   int listenSocketFD = socket(AF_INET, SOCK_STREAM, 0); // Create the socket.  IPv4 family and reliable 2-way byte streaming
+   if (listenSocketFD < 0) {
+	error("ERROR opening socket");
+   }
+
+   // A restarted instance may rebind while its old connections are in TIME_WAIT
+   int reuse = 1;
+   setsockopt(listenSocketFD, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+   // Enable the socket to begin listening.  Bind server address file to socket stored in file descriptor
+   if (bind(listenSocketFD, (struct sockaddr *)&serverAddress, sizeof(serverAddress)) < 0) {
+   	error("ERROR on binding");
+   }
+
+   listen(listenSocketFD, 5); // Flip the socket on - it can now receive up to 5 connections at a time
+
+   return listenSocketFD;
+}
+
+// Earliest moment the connection in this slot is out of time
+static uint64_t connectionDeadline(struct connectionSlot* slot, uint64_t now) {
+   uint64_t idleDeadline = slot->lastActivity + idleMs;
+   uint64_t phaseDeadline;
+
+   switch(slot->phase) {
+	case PHASEHANDSHAKE:
+		phaseDeadline = slot->phaseStarted + handshakeMs;
+		break;
+	case PHASEMESSAGE:
+		phaseDeadline = slot->phaseStarted + messageMs;
+		break;
+	case PHASEWORK:
+		return now + idleMs;  // Not waiting on the peer, look again later
+	default:
+		return idleDeadline;
+   }
+   return phaseDeadline < idleDeadline ? phaseDeadline : idleDeadline;
+}
+
+static void armConnectionTimer(struct connectionSlot* slot, uint64_t deadline) {
+   addTimer(&wheel, &slot->timer, (deadline + TICKMS - 1) / TICKMS);
+}
+
+static void connectionTimerExpired(struct timer* timer) {
+   struct connectionSlot* slot = (struct connectionSlot*)timer;  // Timer is the slot's first member
+   uint64_t now = monotonicMs();
+   uint64_t deadline = connectionDeadline(slot, now);
+
+   // The child has made progress since the timer was armed
+   if (deadline > now) {
+	armConnectionTimer(slot, deadline);
+	return;
+   }
+
+   // Killing the child closes its socket, the slot is freed when it is reaped
+   fprintf(stderr, "Connection %d missed its deadline, closing\n", (int)slot->pid);
+   kill(slot->pid, SIGKILL);
+}
+
+// Free the slots of every child that has exited, writing the capture record of any that was killed
+static void reapChildren(void) {
+   pid_t pid;
+   int status;
+   while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+	struct connectionSlot* slot = findConnectionSlot(pid);
+	if (slot != NULL) {
+		if (WIFSIGNALED(status)) captureKilled(slot - connectionTable);
+		releaseConnection(slot->cpu);
+		releaseKeyPin(keyCache, slot - connectionTable);
+		cancelTimer(&slot->timer);
+		forgetConnection(slot - connectionTable);
+		slot->pid = 0;
+	}
+   }
+}
+
+// Child side, verify the client's token and hand over to the daemon's handler
+static void serveConnection(int establishedConnectionFD, const char* token, requestHandler handler, struct keyCache* keyCache) {
+   char clientToken[100];
+   int charsRead, charsWritten;
+
+   memset(clientToken, '\0', sizeof(clientToken));  // clear buffer
+   charsRead = recv(establishedConnectionFD, clientToken, sizeof(clientToken) - 1, 0);  // receive authentication token from client
+   if (charsRead < 0) error("ERROR reading from socket");
+
+   // Verify authentication token
+   if (strcmp(clientToken, token) != 0) {
+	charsWritten = send(establishedConnectionFD, "failed", 6, 0); // Send failed token message to client
+	if (charsWritten < 0) error("ERROR writing to socket");
+	OTP_PROBE2(auth, currentSerial, 0);
+	captureRejected();
+	exit(0);
+   }
+   charsWritten = send(establishedConnectionFD, "success", 7, 0);  // Send success token message to client
+   if (charsWritten < 0) error("ERROR writing to socket");
+   OTP_PROBE2(auth, currentSerial, 1);
+   beginPhase(PHASEIDLE);
+
+   // A peer that leaves before its first request, like a router retiring a pooled connection, is not an error
+   char first;
+   if (recv(establishedConnectionFD, &first, 1, MSG_PEEK) == 0) exit(0);
+   captureFirstRequest();
+
+   handler(establishedConnectionFD, keyCache);
+   captureComplete();
+}
+
+void sendCiphered(int communicationFD, cipherKernel kernel, const char* msg, const char* key, size_t length) {
+   struct otpBuffer* output = acquireBuffer(length < SCHEDQUANTUM ? length : SCHEDQUANTUM);
+
+   beginPhase(PHASEMESSAGE);
+   sendMessageHeader(communicationFD, length);
+
+   // The grant covers the kernel and the quantum's chunks, unless the peer is slow to ack them
+   beginScheduledSend();
+   for (size_t offset = 0; offset < length; offset += SCHEDQUANTUM) {
+	size_t quantum = length - offset < SCHEDQUANTUM ? length - offset : SCHEDQUANTUM;
+	holdGrant(quantum);
+	OTP_PROBE3(cipher_start, currentSerial, offset, quantum);
+	kernel(output->data, msg + offset, key + offset, quantum);
+	OTP_PROBE3(cipher_end, currentSerial, offset, quantum);
+	sendMessageChunks(communicationFD, output->data, quantum);
+	yieldGrant();
+   }
+   endScheduledSend();
+   beginPhase(PHASEIDLE);
+
+   releaseBuffer(output);
+}
+
+// Accept one connection and fork its child, pinned near its packets when placing connections
+static void acceptConnection(const char* token, requestHandler handler, struct keyCache* keyCache) {
+   struct sockaddr_in clientAddress;
+   socklen_t sizeOfClientInfo = sizeof(clientAddress); // Get the size of the address for the client that will connect
+   int establishedConnectionFD, pid, cpu = -1;
+
+   establishedConnectionFD = accept(listenSocketFD, (struct sockaddr *)&clientAddress, &sizeOfClientInfo);
+   if (establishedConnectionFD < 0) {
+	error("ERROR on accept");
+   }
+
+   // An ACK followed by the next header is two writes before a read, Nagle would hold the second one
+   int noDelay = 1;
+   setsockopt(establishedConnectionFD, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+
+   struct connectionSlot* slot = claimConnectionSlot();
+   if (slot == NULL) {
+	fprintf(stderr, "Too many open connections, refusing one\n");
+	close(establishedConnectionFD);
+	return;
+   }
+   slot->clientAddress = clientAddress.sin_addr.s_addr;
+   slot->client = peerClient(slot->clientAddress, slot->serial);  // Until the request names its client
+   if (!admitClient(slot)) {
+	fprintf(stderr, "Client %s already has its share of connections, refusing one\n", inet_ntoa(clientAddress.sin_addr));
+	close(establishedConnectionFD);
+	return;
+   }
+   captureAccepted(slot - connectionTable, slot->serial);
+
+   // One listener takes every connection, each accepted socket still knows which CPU its packets arrive on
+   if (placement) {
+	int incomingCpu;
+	socklen_t size = sizeof(incomingCpu);
+	if (getsockopt(establishedConnectionFD, SOL_SOCKET, SO_INCOMING_CPU, &incomingCpu, &size) < 0) incomingCpu = -1;
+	cpu = placeConnection(incomingCpu);
+   }
+
+   // Connection established, create child process
+   pid = fork();
+   switch(pid) {
+	// (-1) error creating child process
+	case -1:
+		perror("Hull Breach!");
+		exit(1);
+
+	// Child created successfully, pinned before it allocates so its memory is local
+	case 0:
+		close(listenSocketFD);
+		if (handoffSocketFD >= 0) close(handoffSocketFD);
+		if (cpu >= 0) pinToCpu(cpu);
+		currentConnection = slot;
+		currentSerial = slot->serial;
+		serveConnection(establishedConnectionFD, token, handler, keyCache);
+		exit(0);
+   }
+   slot->pid = pid;
+   slot->cpu = cpu;
+   OTP_PROBE3(accept, slot->serial, pid, slot->clientAddress);
+   slot->timer.callback = connectionTimerExpired;
+   armConnectionTimer(slot, connectionDeadline(slot, monotonicMs()));
+   close(establishedConnectionFD); // Close the ecommunication socket
+}
+
+static void usage(const char* program) {
+   fprintf(stderr,"USAGE: %s [-k cacheMB] [-H handshakeSecs] [-M messageSecs] [-I idleSecs] [-w grants] [-W address=weight]... [-C inflightBytes] [-L clientConnections] [-T capturePath] [-R handoffPath] [-A acceptCores] [-S spoolDir] port\n", program);
+   exit(1);
+}
+
+int runDaemon(int argc, char *argv[], const char* token, requestHandler handler) {
+   int portNumber;
+   int option, cacheMegabytes = DEFAULTCACHEMB;
+   int grants = 0, acceptCores = 0, clientSlots = DEFAULTCLIENTSLOTS;
+   size_t inflightCap = DEFAULTINFLIGHT;
+   const char* handoffPath = NULL;
+
+   // Check usage & args.  -k sets the shared key cache size in MB, 0 turns it off.
+   // -H, -M and -I set the handshake, per-message and idle deadlines in seconds.
+   // -w caps concurrent cipher/send grants, -W weights a client address, -C caps a client's bytes in flight.
+   // -L caps the connections one client may have open.
+   // -T records every request's metadata to a capture file for otp_replay.
+   // -R takes over the listener of the daemon at the handoff path, and hands them on to the next one.
+   // -A places connections on CPUs by topology, keeping that many physical cores for the accept path.
+   // -S accepts resumable transfers, spooling them under the directory.
+   while ((option = getopt(argc, argv, "k:H:M:I:w:W:C:L:T:R:A:S:")) != -1) {
+	switch(option) {
+		case 'k':
+			cacheMegabytes = atoi(optarg);
+			break;
+		case 'H':
+			handshakeMs = (uint64_t)atoi(optarg) * 1000;
+			break;
+		case 'M':
+			messageMs = (uint64_t)atoi(optarg) * 1000;
+			break;
+		case 'I':
+			idleMs = (uint64_t)atoi(optarg) * 1000;
+			break;
+		case 'w':
+			grants = atoi(optarg);
+			break;
+		case 'W':
+			if (!addClientWeight(optarg)) usage(argv[0]);
+			break;
+		case 'C':
+			inflightCap = strtoull(optarg, NULL, 10);
+			break;
+		case 'L':
+			clientSlots = atoi(optarg);
+			break;
+		case 'T':
+			openCapture(optarg);
+			break;
+		case 'R':
+			handoffPath = optarg;
+			break;
+		case 'A':
+			placement = true;
+			acceptCores = atoi(optarg);
+			break;
+		case 'S':
+			openSpool(optarg);
+			break;
+		default:
+			usage(argv[0]);
+	}
+   }
+   if (optind >= argc) {
+	usage(argv[0]);
+   }
+
+   // Read the topology first, so a grant per worker CPU is the default
+   int numWorkers = 0;
+   if (placement) {
+	numWorkers = discoverTopology(acceptCores);
+	if (numWorkers == 0) {
+		fprintf(stderr, "No CPUs left for connections after reserving %d cores\n", acceptCores);
+		exit(1);
+	}
+	if (grants <= 0) grants = numWorkers;
+	pinAcceptPath();
+   }
+
+   // Map shared state before forking so every child sees it
+   keyCache = createKeyCache((size_t)cacheMegabytes * 1024 * 1024);
+   createConnectionTable();
+   createScheduler(grants, inflightCap, clientSlots);
+   initTimerWheel(&wheel, monotonicMs() / TICKMS);
+
+   // Set up listening port on client server to take in client requests, unless a running daemon hands it over
+   portNumber = atoi(argv[optind]);
+   if (handoffPath != NULL) {
+	int received = receiveListeners(handoffPath, &listenSocketFD, 1);
+	if (received < 0) exit(1);
+	if (received > 0) fprintf(stderr, "Took over the listener from the running daemon\n");
+   }
+   if (listenSocketFD < 0) {
+	listenSocketFD = createListener(portNumber);
+   }
+   if (handoffPath != NULL) {
+	handoffSocketFD = openHandoffSocket(handoffPath);
+   }
+
+   while(1) {
+	// Wait up to one tick for a connection or a successor. Once handed over, poll skips both and only waits.
+	struct pollfd listeners[2] = { { listenSocketFD, POLLIN, 0 }, { handoffSocketFD, POLLIN, 0 } };
+	int ready = poll(listeners, 2, TICKMS);
+	if (ready < 0 && errno != EINTR) error("ERROR polling listener");
+
+	// The successor holds the listeners now. Stop accepting and finish what is open.
+	// The exchange takes at most a tick, so a successor that stalls costs the loop no more.
+	if (ready > 0 && listeners[1].revents != 0 && sendListeners(handoffSocketFD, &listenSocketFD, 1, TICKMS)) {
+		fprintf(stderr, "Handed the listener over, draining %d connections\n", openConnections());
+		close(listenSocketFD);
+		close(handoffSocketFD);  // The path belongs to the successor now
+		handoffSocketFD = -1;
+		listenSocketFD = -1;
+	}
+	else if (ready > 0 && listeners[0].revents != 0) {
+		acceptConnection(token, handler, keyCache);
+	}
+
+	reapChildren();
+	advanceTimerWheel(&wheel, monotonicMs() / TICKMS);
+	if (listenSocketFD < 0 && openConnections() == 0) exit(0);
+   }
+
+   return 0;
+}
@@ -0,0 +1,31 @@
+/*******************************************************************************
+** Description: Listener, supervisor, and connection setup shared by otp_enc_d
+**              and otp_dec_d. The supervisor accepts connections and forks a
+**              child for each. It reaps children as they exit, and keeps a
+**              timer wheel with one timer per open connection. When a peer
+**              misses its handshake, message, or idle deadline, the child
+**              serving it is killed, which closes the connection. Each daemon
+**              supplies only its token and the request handler that runs once
+**              the client is verified.
+*******************************************************************************/
+#ifndef OTP_DAEMON_H
+#define OTP_DAEMON_H
+
+#include <stddef.h>
+#include "otp_keycache.h"
+#include "otp_alphabet.h"
+
+#define TICKMS 100                // Timer wheel resolution
+#define DEFAULTHANDSHAKESECS 5    // Accept to verified token
+#define DEFAULTMESSAGESECS 60     // Longest a single message may take
+#define DEFAULTIDLESECS 10        // Longest the socket may sit without progress
+
+typedef void (*requestHandler)(int communicationFD, struct keyCache* keyCache);
+
+// Run kernel over the message and send the result, one scheduler grant per quantum of ciphering
+void sendCiphered(int communicationFD, cipherKernel kernel, const char* msg, const char* key, size_t length);
+
+// Parse daemon options, listen on the port, and serve clients until killed
+int runDaemon(int argc, char *argv[], const char* token, requestHandler handler);
+
+#endif
@@ -7,10 +7,12 @@
 *               to be verified prior to any other data transmission can take
 *               place.  Once the client is verified, otp_dec will send the
 *               ciphertext and key to the otp_enc_d daemon (server) for
-*               decryption. The message and key must only contain uppercase
-*               letters, spaces, and a trailing newline or the program will
-*               exit. The plaintext message is returned to the client.                                                                                                                                                           
+*               decryption. The message and key must only contain symbols
+*               of the alphabet chosen with -a (uppercase letters and space
+*               by default) and a trailing newline or the program will exit.
+*               The plaintext message is returned to the client.
 *******************************************************************************/
+#define _DEFAULT_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -18,13 +20,18 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h> 
 #include <fcntl.h>
 #include <ctype.h>
 #include <stdbool.h>
+#include "otp_buffer.h"
+#include "otp_message.h"
+#include "otp_keycache.h"
+#include "otp_alphabet.h"
+#include "otp_local.h"
+#include "otp_transfer.h"
 
-#define MAXSENDSIZE 1000
-#define MAXSIZE 72000
 #define h_addr h_addr_list[0]
 
 
@@ -34,67 +41,6 @@ void error(const char *msg) {
    exit(0); 
 } 
 
-// Receive plaintext and send ACK to server
-void receiveMessage(int communicationFD, char* buffer) {
-   bool newlineFound = false;
-   char tempBuffer[1001];
-   int totalBytesRead = 0;
-   bool firstPass = true;
-
-   while(!newlineFound) {
-   	memset(tempBuffer, '\0', sizeof(tempBuffer));	       
-        int numBytesRead = recv(communicationFD, tempBuffer, sizeof(tempBuffer), 0);
-        totalBytesRead += numBytesRead;
-	   
-        if (numBytesRead > 0) {
-           for (int i=0; i<numBytesRead; i++) {
-                char c = tempBuffer[i];
-                if (c == '*') {
-                       // printf("* End of message!\n");
-                        tempBuffer[i] = '\0';
-                        newlineFound = true;
-                        break;
-                }
-           }
-           strcat(buffer, tempBuffer);
-        }
-
-        send(communicationFD, "Client has received message\n", 28 , 0);
-    }
-}
-
-
-// Sends key and ciphertext to server
-void sendMessage(int socketFD, char* buffer, int msgLength) {
-   int curMsgLength, charsRead;
-   int charsWritten = 0;
-   int charsRemaining = msgLength;
-   bool firstPass = true;
-
-   char ackBuffer[100];
-   memset(ackBuffer, '\0', 100);
-
-   while(charsWritten < msgLength) {
-	char tempBuffer[1001];
-	memset(tempBuffer, '\0', sizeof(tempBuffer));
-	if ((firstPass) && (charsRemaining > MAXSENDSIZE)) {
-		strncpy(tempBuffer, buffer, MAXSENDSIZE);
-		firstPass = false;
-	}
-	else if (charsRemaining > MAXSENDSIZE) {
-		strncpy(tempBuffer, buffer + charsWritten, MAXSENDSIZE);
-	}
-	else {
-		strncpy(tempBuffer, buffer + charsWritten, charsRemaining);  // Copy current transmission cycle into the temp buffer 
-		tempBuffer[charsRemaining] = '*';  // Delimiter to specify end of message
-	}
-   	curMsgLength = strlen(tempBuffer);
-	charsWritten += send(socketFD, tempBuffer, curMsgLength, 0); 
-	charsRead = recv(socketFD, ackBuffer, sizeof(ackBuffer), 0);
-	charsRemaining = msgLength - charsWritten;
-   }
-}
-
 // Send authentication token to server
 void authenticationHandshake(int socketFD, int portNumber) {
    char clientToken[] = "jambalaya";
@@ -140,83 +86,109 @@ int createSocket(int portNumber) {
    if (connect(socketFD, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) < 0) 
 		error("CLIENT: ERROR connecting");
 
+   // The message layer often writes twice before reading, Nagle would hold the second write for the peer's delayed ACK
+   int noDelay = 1;
+   setsockopt(socketFD, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+
+   return socketFD;
+}
+
+// Connect and authenticate, once per attempt for a resumable transfer
+int connectToDaemon(int portNumber) {
+   int socketFD = createSocket(portNumber);
+   authenticationHandshake(socketFD, portNumber);
    return socketFD;
 }
 
 int main(int argc, char *argv[])
 {
-   int i, socketFD, portNumber, charsWritten, charsRead;
-   int ciphertext_fd, ciphertextLength;
-   char ciphertextBuffer[MAXSIZE];
-   ssize_t ret_ciphertext;  // Number of bytes returned by read() ciphertext file
-   int key_fd, keyLength;
-   char keyBuffer[MAXSIZE];
-   ssize_t ret_key;  // Number of bytes returned by read() key file
+   int socketFD, portNumber;
+   struct otpBuffer *ciphertextBuffer, *keyBuffer;
+   int option;
+   bool localMode = false;
+   const char* transferId = NULL;
+   const char* clientId = NULL;
+   const struct alphabet* alphabet = findAlphabet(DEFAULTALPHABET);
     
    // Check correct number of arguments were passed in
-   // Argument # - 1.Program Name, 2. Ciphertext, 3. Key, 4. Listening Port #
-   if (argc != 4) { fprintf(stderr,"USAGE: %s otp_enc plaintext key port\n", argv[0]); exit(0); } // Check usage & args
+   // Options - -a alphabet, -l local mode, -r resumable transfer id, -c client id for the daemon's scheduler.  Argument # - 1. Ciphertext, 2. Key, 3. Listening Port # (not with -l)
+   while ((option = getopt(argc, argv, "a:lr:c:")) != -1) {
+	if (option == 'a' && (alphabet = findAlphabet(optarg)) != NULL) {
+		continue;
+	}
+	if (option == 'l') {
+		localMode = true;
+		continue;
+	}
+	if (option == 'r' && validTransferId(optarg)) {
+		transferId = optarg;
+		continue;
+	}
+	if (option == 'c' && validTransferId(optarg)) {  // Same rules as a transfer id
+		clientId = optarg;
+		continue;
+	}
+	fprintf(stderr,"USAGE: %s [-a alphabet] [-r transferId] [-c clientId] ciphertext key port | -l [-a alphabet] ciphertext key\n", argv[0]);
+	exit(0);
+   }
+   if ((localMode && (transferId != NULL || clientId != NULL)) || argc - optind != (localMode ? 2 : 3)) { fprintf(stderr,"USAGE: %s [-a alphabet] [-r transferId] [-c clientId] ciphertext key port | -l [-a alphabet] ciphertext key\n", argv[0]); exit(0); } // Check usage & args
+   char** files = argv + optind;
+
+   // Local mode runs the daemon's kernel in this process
+   if (localMode) {
+	runLocal(alphabet, alphabet->decode, files[0], files[1]);
+	return 0;
+   }
 
    // Attempt to establish connection with server
-   portNumber = atoi(argv[3]); // Get port number
-   socketFD = createSocket(portNumber);
-	
-   // Client/Server authentication handshake.
-   authenticationHandshake(socketFD, portNumber);
+   portNumber = atoi(files[2]); // Get port number
+   socketFD = -1;
+   if (transferId == NULL) {
+	socketFD = connectToDaemon(portNumber);  // Client/Server authentication handshake included
+   }
 
-   // Get and Open ciphertext file
-   ciphertext_fd = open(argv[1], O_RDONLY);
-	
-   if (ciphertext_fd < 0) {
-	perror("Failed to open file!");
+   // Read ciphertext file
+   ciphertextBuffer = readTextFile(files[0]);
+
+   // Check ciphertext buffer to ensure all characters are valid
+   if (alphabet->validate(ciphertextBuffer->data, ciphertextBuffer->length) != ciphertextBuffer->length) {
+	fprintf(stderr, "Invalid character(s) found in %s file!\n", files[0]);
 	exit(1);
    }
-   memset(ciphertextBuffer, '\0', MAXSIZE); 	
-   ret_ciphertext = read(ciphertext_fd, ciphertextBuffer, sizeof(ciphertextBuffer));  
-   ciphertextLength = strlen(ciphertextBuffer); 
 	
-   // Open generated key file
-   key_fd = open(argv[2], O_RDONLY);
-	
-   if (key_fd < 0) {
-	perror("Failed to open file!");
-	exit(1);
-   }
-   memset(keyBuffer, '\0', MAXSIZE);  	
-   ret_key = read(key_fd, keyBuffer, sizeof(keyBuffer));  
-   keyLength = strlen(keyBuffer);  
+   // Read generated key file
+   keyBuffer = readTextFile(files[1]);
 
    // Check key buffer to ensure all characters are valid
-   for (i =0; i < keyLength; i++) { 	
-	if ((!isupper(keyBuffer[i])) && (!isspace(keyBuffer[i])) && (keyBuffer[i] != '\n')) {
-		fprintf(stderr, "Invalid character found in key!");
-		exit(1);
-	}
+   if (alphabet->validate(keyBuffer->data, keyBuffer->length) != keyBuffer->length) { 	
+	fprintf(stderr, "Invalid character found in key!");
+	exit(1);
    }
 
    // Compare length of ciphertext and key
-   if (ciphertextLength > keyLength) {
+   if (ciphertextBuffer->length > keyBuffer->length) {
 	fprintf(stderr, "Error! Key length less than plaintext length!");
 	exit(1);
    }
 
+   // A resumable transfer connects for itself, again after any drop
+   if (transferId != NULL) {
+	runTransfer(transferId, alphabet, ciphertextBuffer, keyBuffer, clientId, portNumber, connectToDaemon);
+	return 0;
+   }
+
    // Send ciphertext and key to daemon for decyrption
-   sendMessage(socketFD, ciphertextBuffer, ciphertextLength);
-   sendMessage(socketFD, keyBuffer, keyLength);
+   char request[128];  // The alphabet, and the client if one was named
+   int requestLength = snprintf(request, sizeof(request), "%s%s%s", alphabet->name, clientId != NULL ? CLIENTTAG : "", clientId != NULL ? clientId : "");
+   sendMessage(socketFD, request, requestLength);
+   sendMessage(socketFD, ciphertextBuffer->data, ciphertextBuffer->length);
+   sendKey(socketFD, keyBuffer->data, keyBuffer->length);
     
    // Receive plaintext
-   char plaintext[ciphertextLength + 1];
-   memset(plaintext, '\0', sizeof(plaintext));
-   receiveMessage(socketFD, plaintext); 	
-   int plaintextLength = strlen(plaintext);
+   struct otpBuffer* plaintext = receiveMessage(socketFD, CLIENTACK);
 
    // Print plaintext to stdout
-   for(i = 0; i < plaintextLength; i++) {
-	if (plaintext[i] == '[') {
-		plaintext[i] = ' '; 
-	}
-	printf("%c", plaintext[i]);
-   }
+   fwrite(plaintext->data, 1, plaintext->length, stdout);
    printf("\n");
  
    close(socketFD);
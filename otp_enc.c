@@ -7,11 +7,13 @@
 *               to be verified prior to any other data transmission can take
 *               place.  Once the client is verified, otp_enc will send the
 *               message and key to the otp_enc_d daemon (server) for
-*               encryption. The message and key must only contain uppercase
-*               letters, spaces, and a trailing newline or the program will
-*               exit. The ciphertext is returned to the client.
+*               encryption. The message and key must only contain symbols
+*               of the alphabet chosen with -a (uppercase letters and space
+*               by default) and a trailing newline or the program will exit.
+*               The ciphertext is returned to the client.
 *******************************************************************************/
 
+#define _DEFAULT_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -19,13 +21,18 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h> 
 #include <fcntl.h>
 #include <ctype.h>
 #include <stdbool.h>
+#include "otp_buffer.h"
+#include "otp_message.h"
+#include "otp_keycache.h"
+#include "otp_alphabet.h"
+#include "otp_local.h"
+#include "otp_transfer.h"
 
-#define MAXSENDSIZE 1000
-#define MAXSIZE 72000
 #define h_addr h_addr_list[0]
 
 
@@ -35,64 +42,6 @@ void error(const char *msg) {
    exit(0); 
 } 
 
-// Receive ciphertext from server, reply with ACK
-void receiveMessage(int communicationFD, char* buffer) {
-    bool newlineFound = false;
-    char tempBuffer[1001];
-    int totalBytesRead = 0;
-    bool firstPass = true;
-
-    while(!newlineFound) {
-        int numBytesRead = recv(communicationFD, tempBuffer, sizeof(tempBuffer), 0);
-        totalBytesRead += numBytesRead;  
-	// Read until no bytes left in transmission
-        if (numBytesRead > 0) {
-           for (int i = 0; i < numBytesRead; i++) {
-                char c = tempBuffer[i];
-                if (c == '*') {
-                        tempBuffer[i] = '\0';
-                        newlineFound = true;
-                        break;
-                }
-           }
-           strcat(buffer, tempBuffer);  
-        }
-        send(communicationFD, "Client has received message\n", 28 , 0);  // ack
-    }
-}
-
-// Send plaintext to server
-void sendMessage(int socketFD, char* buffer, int msgLength) {
-   int curMsgLength, charsRead;
-   int charsWritten = 0;
-   int charsRemaining = msgLength;
-   bool firstPass = true;
-
-   
-   char ackBuffer[100];
-   memset(ackBuffer, '\0', 100);
-
-   while(charsWritten < msgLength) {
-	char tempBuffer[1001];
-	memset(tempBuffer, '\0', sizeof(tempBuffer));
-	if ((firstPass) && (charsRemaining > MAXSENDSIZE)) {
-		strncpy(tempBuffer, buffer, MAXSENDSIZE);
-		firstPass = false;
-	}
-	else if (charsRemaining > MAXSENDSIZE) {
-		strncpy(tempBuffer, buffer + charsWritten, MAXSENDSIZE);
-	}
-	else {
-		strncpy(tempBuffer, buffer + charsWritten, charsRemaining);
-		tempBuffer[charsRemaining] = '*'; 
-	}
-   	curMsgLength = strlen(tempBuffer);	
-	charsWritten += send(socketFD, tempBuffer, curMsgLength, 0); 
-	charsRead = recv(socketFD, ackBuffer, sizeof(ackBuffer), 0);
-	charsRemaining = msgLength - charsWritten;
-   }
-}
-
 void authenticationHandshake(int socketFD, int portNumber) {
    char clientToken[] = "redWolf7";
    int charsWritten, charsRead;
@@ -136,93 +85,108 @@ int createSocket(int portNumber) {
    if (connect(socketFD, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) < 0) // Connect socket to address
 		error("CLIENT: ERROR connecting");
 
+   // The message layer often writes twice before reading, Nagle would hold the second write for the peer's delayed ACK
+   int noDelay = 1;
+   setsockopt(socketFD, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+
+   return socketFD;
+}
+
+// Connect and authenticate, once per attempt for a resumable transfer
+int connectToDaemon(int portNumber) {
+   int socketFD = createSocket(portNumber);
+   authenticationHandshake(socketFD, portNumber);
    return socketFD;
 }
 
 int main(int argc, char *argv[])
 {
-	int i, socketFD, portNumber, charsWritten, charsRead;
-	int plaintext_fd, plaintextLength;
-	char plaintextBuffer[MAXSIZE];
-	ssize_t ret_plaintext;  // Number of bytes returned by read() plaintext file
-	int key_fd, keyLength;
-	char keyBuffer[MAXSIZE];
-	ssize_t ret_key;  // Number of bytes returned by read() key file
+	int socketFD, portNumber;
+	struct otpBuffer *plaintextBuffer, *keyBuffer;
+	int option;
+	bool localMode = false;
+	const char* transferId = NULL;
+	const char* clientId = NULL;
+	const struct alphabet* alphabet = findAlphabet(DEFAULTALPHABET);
     
 	// Check correct number of arguments were passed in
-	// Argument # - 1.Program Name, 2. Plaintext, 3. Key, 4. Encryped port #
-	if (argc != 4) { fprintf(stderr,"USAGE: %s otp_enc plaintext key port\n", argv[0]); exit(0); } // Check usage & args
+	// Options - -a alphabet, -l local mode, -r resumable transfer id, -c client id for the daemon's scheduler.  Argument # - 1. Plaintext, 2. Key, 3. Encryped port # (not with -l)
+	while ((option = getopt(argc, argv, "a:lr:c:")) != -1) {
+		if (option == 'a' && (alphabet = findAlphabet(optarg)) != NULL) {
+			continue;
+		}
+		if (option == 'l') {
+			localMode = true;
+			continue;
+		}
+		if (option == 'r' && validTransferId(optarg)) {
+			transferId = optarg;
+			continue;
+		}
+		if (option == 'c' && validTransferId(optarg)) {  // Same rules as a transfer id
+			clientId = optarg;
+			continue;
+		}
+		fprintf(stderr,"USAGE: %s [-a alphabet] [-r transferId] [-c clientId] plaintext key port | -l [-a alphabet] plaintext key\n", argv[0]);
+		exit(0);
+	}
+	if ((localMode && (transferId != NULL || clientId != NULL)) || argc - optind != (localMode ? 2 : 3)) { fprintf(stderr,"USAGE: %s [-a alphabet] [-r transferId] [-c clientId] plaintext key port | -l [-a alphabet] plaintext key\n", argv[0]); exit(0); } // Check usage & args
+	char** files = argv + optind;
 
-	// Attempt to establish connection with server
-	portNumber = atoi(argv[3]); // Get the clients port number
-	socketFD = createSocket(portNumber);
-	
-	// Client/Server authentication handshake.
-	authenticationHandshake(socketFD, portNumber);
+	// Local mode runs the daemon's kernel in this process
+	if (localMode) {
+		runLocal(alphabet, alphabet->encode, files[0], files[1]);
+		return 0;
+	}
 
-	// Get and Open plaintext file
-	plaintext_fd = open(argv[1], O_RDONLY);
-	
-	// Failed to open file
-	if (plaintext_fd < 0) {
-		perror("Failed to open file!");
-		exit(1);
+	// Attempt to establish connection with server
+	portNumber = atoi(files[2]); // Get the clients port number
+	socketFD = -1;
+	if (transferId == NULL) {
+		socketFD = connectToDaemon(portNumber);  // Client/Server authentication handshake included
 	}
-	memset(plaintextBuffer, '\0', MAXSIZE);  	
-	ret_plaintext = read(plaintext_fd, plaintextBuffer, sizeof(plaintextBuffer)); 
-	plaintextLength = strlen(plaintextBuffer);  
+
+	// Read plaintext file
+	plaintextBuffer = readTextFile(files[0]);
 
 	// Check plaintext buffer to ensure all characters are valid
-	for (i =0; i < plaintextLength; i++) { 
-		if ((!isupper(plaintextBuffer[i])) && (!isspace(plaintextBuffer[i])) && (plaintextBuffer[i] != '\n')) {
-			fprintf(stderr, "Invalid character(s) found in %s file!\n", argv[1]);
-			exit(1);
-		}
-	}
-	
-	// Open generated key file
-	key_fd = open(argv[2], O_RDONLY);
-	
-	// Failed to open file
-	if (key_fd < 0) {
-		perror("Failed to open file!");
+	if (alphabet->validate(plaintextBuffer->data, plaintextBuffer->length) != plaintextBuffer->length) { 
+		fprintf(stderr, "Invalid character(s) found in %s file!\n", files[0]);
 		exit(1);
 	}
-	memset(keyBuffer, '\0', MAXSIZE);  	
-	ret_key = read(key_fd, keyBuffer, sizeof(keyBuffer));  
-	keyLength = strlen(keyBuffer);  
+	
+	// Read generated key file
+	keyBuffer = readTextFile(files[1]);
 
 	// Check key buffer to ensure all characters are valid
-	for (i =0; i < keyLength; i++) { 	
-		if ((!isupper(keyBuffer[i])) && (!isspace(keyBuffer[i])) && (keyBuffer[i] != '\n')) {
-			fprintf(stderr, "Invalid character found in key!");
-			exit(1);
-		}
+	if (alphabet->validate(keyBuffer->data, keyBuffer->length) != keyBuffer->length) { 	
+		fprintf(stderr, "Invalid character found in key!");
+		exit(1);
 	}
 
 	// Compare length of plaintext and key
-	if (plaintextLength > keyLength) {
+	if (plaintextBuffer->length > keyBuffer->length) {
 		fprintf(stderr, "Error! Key length less than plaintext length!");
 		exit(1);
 	}
 
-	sendMessage(socketFD, plaintextBuffer, plaintextLength);
-   	sendMessage(socketFD, keyBuffer, keyLength);
+	// A resumable transfer connects for itself, again after any drop
+	if (transferId != NULL) {
+		runTransfer(transferId, alphabet, plaintextBuffer, keyBuffer, clientId, portNumber, connectToDaemon);
+		return 0;
+	}
+
+	char request[128];  // The alphabet, and the client if one was named
+	int requestLength = snprintf(request, sizeof(request), "%s%s%s", alphabet->name, clientId != NULL ? CLIENTTAG : "", clientId != NULL ? clientId : "");
+	sendMessage(socketFD, request, requestLength);
+	sendMessage(socketFD, plaintextBuffer->data, plaintextBuffer->length);
+   	sendKey(socketFD, keyBuffer->data, keyBuffer->length);
     
 	// Receive Cipher Text
-	char ciphertext[plaintextLength + 1];
-	
-	memset(ciphertext, '\0', sizeof(ciphertext));
-	receiveMessage(socketFD, ciphertext); 	
-	int ciphertextLength = strlen(ciphertext);
+	struct otpBuffer* ciphertext = receiveMessage(socketFD, CLIENTACK);
 
 	// Print ciphertext to stdout
-	for(i = 0; i < ciphertextLength; i++) {
-		if (ciphertext[i] == '[') {
-			ciphertext[i] = ' '; // Change bracket back to space
-		}
-		printf("%c", ciphertext[i]);
-	}
+	fwrite(ciphertext->data, 1, ciphertext->length, stdout);
        printf("\n");
  
    close(socketFD);
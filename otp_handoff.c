@@ -0,0 +1,179 @@
+/*******************************************************************************
+** Description: Listener handoff implementation. The exchange is a request
+**              byte, one byte back with the descriptors attached, a byte
+**              saying the new daemon holds them, and a last byte from the old
+**              daemon saying it has stopped accepting. If the new daemon dies
+**              or takes longer than the running daemon allows, the old daemon
+**              keeps accepting as if nothing happened. Its closed connection
+**              is what tells the new daemon so, and it closes what it
+**              received instead of serving the listeners twice. Each side checks with SO_PEERCRED that
+**              the other runs as the same user, and the socket is created
+**              with mode 0600, so no other user can take the listeners or
+**              plant ones of their own.
+*******************************************************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "otp_handoff.h"
+
+void error(const char *msg);  // Supplied by each program
+
+#define HANDOFFREQUEST 'L'
+#define HANDOFFREADY 'R'
+#define HANDOFFDONE 'D'
+
+static bool fillAddress(struct sockaddr_un* address, const char* path) {
+   memset(address, '\0', sizeof(*address));
+   address->sun_family = AF_UNIX;
+   if (strlen(path) >= sizeof(address->sun_path)) {
+	fprintf(stderr, "Handoff path %s is too long\n", path);
+	return false;
+   }
+   strcpy(address->sun_path, path);
+   return true;
+}
+
+static bool readableWithin(int socketFD, int timeoutMs) {
+   struct pollfd peer = { socketFD, POLLIN, 0 };
+   return poll(&peer, 1, timeoutMs > 0 ? timeoutMs : 0) > 0;
+}
+
+// Only a process of the same user may hand over or take the listeners
+static bool peerIsOwner(int socketFD) {
+   struct ucred peer;
+   socklen_t size = sizeof(peer);
+
+   if (getsockopt(socketFD, SOL_SOCKET, SO_PEERCRED, &peer, &size) < 0) return false;
+   if (peer.uid != geteuid()) {
+	fprintf(stderr, "Handoff peer runs as uid %d, refusing it\n", (int)peer.uid);
+	return false;
+   }
+   return true;
+}
+
+int receiveListeners(const char* path, int* fds, int maxFDs) {
+   struct sockaddr_un address;
+   char request = HANDOFFREQUEST, ready = HANDOFFREADY, done, tag;
+   char control[CMSG_SPACE(MAXHANDOFF * sizeof(int))];
+   struct iovec byte = { &tag, 1 };
+   struct msghdr message;
+
+   if (!fillAddress(&address, path)) return 0;
+   int socketFD = socket(AF_UNIX, SOCK_STREAM, 0);
+   if (socketFD < 0) error("ERROR opening handoff socket");
+
+   // Nothing there, or a socket left behind by a daemon that has gone
+   if (connect(socketFD, (struct sockaddr*)&address, sizeof(address)) < 0 || !peerIsOwner(socketFD)) {
+	close(socketFD);
+	return 0;
+   }
+
+   memset(&message, '\0', sizeof(message));
+   message.msg_iov = &byte;
+   message.msg_iovlen = 1;
+   message.msg_control = control;
+   message.msg_controllen = sizeof(control);
+   if (send(socketFD, &request, 1, MSG_NOSIGNAL) != 1 || !readableWithin(socketFD, HANDOFFTIMEOUTMS) ||
+       recvmsg(socketFD, &message, 0) != 1 || tag != HANDOFFREQUEST) {
+	close(socketFD);
+	return 0;
+   }
+
+   int count = 0;
+   for (struct cmsghdr* header = CMSG_FIRSTHDR(&message); header != NULL; header = CMSG_NXTHDR(&message, header)) {
+	if (header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS) continue;
+	int received = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+	for (int i = 0; i < received; i++) {
+		int fd;
+		memcpy(&fd, CMSG_DATA(header) + i * sizeof(int), sizeof(int));
+		if (count < maxFDs) fds[count++] = fd;
+		else close(fd);
+	}
+   }
+
+   if (count == 0) {
+	close(socketFD);
+	return 0;
+   }
+
+   // The running daemon may have given up before the answer arrived, then it still accepts
+   if (send(socketFD, &ready, 1, MSG_NOSIGNAL) != 1 || !readableWithin(socketFD, HANDOFFTIMEOUTMS) ||
+       recv(socketFD, &done, 1, 0) != 1 || done != HANDOFFDONE) {
+	fprintf(stderr, "The running daemon at %s kept its listeners\n", path);
+	for (int i = 0; i < count; i++) close(fds[i]);
+	close(socketFD);
+	return -1;
+   }
+   close(socketFD);
+   return count;
+}
+
+int openHandoffSocket(const char* path) {
+   struct sockaddr_un address;
+
+   if (!fillAddress(&address, path)) error("ERROR on handoff path");
+   int handoffSocketFD = socket(AF_UNIX, SOCK_STREAM, 0);
+   if (handoffSocketFD < 0) error("ERROR opening handoff socket");
+
+   // The previous daemon has handed over by now, or is gone. Created 0600, connecting needs write permission.
+   unlink(path);
+   mode_t previousMask = umask(077);
+   int bound = bind(handoffSocketFD, (struct sockaddr*)&address, sizeof(address));
+   umask(previousMask);
+   if (bound < 0) error("ERROR binding handoff socket");
+   listen(handoffSocketFD, 1);
+
+   return handoffSocketFD;
+}
+
+static int elapsedMs(const struct timespec* start) {
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+bool sendListeners(int handoffSocketFD, const int* fds, int count, int timeoutMs) {
+   char tag = HANDOFFREQUEST, done = HANDOFFDONE, reply;
+   char control[CMSG_SPACE(MAXHANDOFF * sizeof(int))];
+   struct iovec byte = { &tag, 1 };
+   struct msghdr message;
+   bool confirmed = false;
+   struct timespec start;
+
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   int successorFD = accept(handoffSocketFD, NULL, NULL);
+   if (successorFD < 0) return false;
+
+   // Wait for the request, a stray connection or another user's gets nothing
+   if (!peerIsOwner(successorFD) || !readableWithin(successorFD, timeoutMs) ||
+       recv(successorFD, &reply, 1, 0) != 1 || reply != HANDOFFREQUEST) {
+	close(successorFD);
+	return false;
+   }
+
+   memset(&message, '\0', sizeof(message));
+   memset(control, '\0', sizeof(control));
+   message.msg_iov = &byte;
+   message.msg_iovlen = 1;
+   message.msg_control = control;
+   message.msg_controllen = CMSG_SPACE(count * sizeof(int));
+   struct cmsghdr* header = CMSG_FIRSTHDR(&message);
+   header->cmsg_level = SOL_SOCKET;
+   header->cmsg_type = SCM_RIGHTS;
+   header->cmsg_len = CMSG_LEN(count * sizeof(int));
+   memcpy(CMSG_DATA(header), fds, count * sizeof(int));
+
+   if (sendmsg(successorFD, &message, MSG_NOSIGNAL) == 1 && readableWithin(successorFD, timeoutMs - elapsedMs(&start)) &&
+       recv(successorFD, &reply, 1, 0) == 1 && reply == HANDOFFREADY && send(successorFD, &done, 1, MSG_NOSIGNAL) == 1) {
+	confirmed = true;
+   }
+   close(successorFD);
+   return confirmed;
+}
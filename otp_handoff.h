@@ -0,0 +1,32 @@
+/*******************************************************************************
+** Description: Listener handoff for hot restarts. A daemon started with -R
+**              listens on a Unix socket at the given path. A new daemon
+**              started with the same path connects there first. The running
+**              daemon passes it the listening sockets with SCM_RIGHTS, and
+**              the new daemon answers once it holds them. Only then does the
+**              old daemon stop accepting, and it says so, and only once it
+**              has does the new daemon start. The listening sockets are never
+**              closed in between, so connections waiting in the backlog are
+**              accepted by the new daemon instead of being refused.
+*******************************************************************************/
+#ifndef OTP_HANDOFF_H
+#define OTP_HANDOFF_H
+
+#include <stdbool.h>
+
+#define MAXHANDOFF 64             // Most listening sockets passed at once
+#define HANDOFFTIMEOUTMS 5000     // Longest the new daemon waits for the running one
+
+// New daemon: take the listeners of the daemon serving path into fds.
+// Returns how many were received, 0 when no daemon answers there,
+// and -1 when the running daemon kept its listeners after all.
+int receiveListeners(const char* path, int* fds, int maxFDs);
+
+// Listen on path for the next daemon, replacing whatever is there
+int openHandoffSocket(const char* path);
+
+// Running daemon, handoffSocketFD readable: pass fds to the new daemon, spending at most
+// timeoutMs on the whole exchange. True once the new daemon holds them and has been told to start.
+bool sendListeners(int handoffSocketFD, const int* fds, int count, int timeoutMs);
+
+#endif
@@ -0,0 +1,369 @@
+/*******************************************************************************
+** Description: Key cache implementation. The mapping holds a header with a
+**              process-shared mutex, a bucket array, a slot table, a block
+**              chain table, and the key blocks themselves. There is one slot
+**              and one bucket per block, the most entries the blocks could
+**              hold. Fixed-size blocks keep the mapping from fragmenting,
+**              whatever mix of key sizes arrives. The CLOCK hand gives every
+**              slot touched since its last pass a second chance before its
+**              blocks are reused. A hit pins its slot and copies the key with
+**              the lock released, so a large key never holds up the other
+**              children. Pinned slots are never evicted. Each connection
+**              records the slot it pinned, so the supervisor can release the
+**              pin of a child that died while copying.
+*******************************************************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "otp_keycache.h"
+#include "otp_message.h"
+#include "otp_capture.h"
+#include "otp_connection.h"
+
+void error(const char *msg);  // Supplied by each program
+
+#define EMPTYSLOT -1
+
+struct keySlot {
+   uint64_t digest;
+   size_t length;
+   int firstBlock;   // Chain through blockNext, EMPTYSLOT for an empty key
+   int bucketNext;   // Next slot in the same bucket, or EMPTYSLOT
+   bool inUse;
+   bool referenced;  // Set on every hit, cleared as the CLOCK hand passes
+   int pins;         // Children copying the key out
+};
+
+struct keyCache {
+   pthread_mutex_t lock;
+   int numSlots;          // Also the number of blocks
+   int clockHand;
+   int freeBlock;         // Head of the free block chain
+   int numFree;
+   uint64_t resets;       // Times the cache was emptied, a copy that spans one is discarded
+   int pinnedSlot[MAXCONNECTIONS];  // Slot each connection's child has pinned, or EMPTYSLOT
+   int* buckets;          // numSlots chains of slot indexes
+   int* blockNext;        // Next block of the same key or of the free chain
+   struct keySlot* slots;
+   char* keys;            // numSlots * KEYBLOCKSIZE bytes
+};
+
+// Every slot empty, every block free.  Caller holds the lock or has not shared the cache yet.
+static void emptyCache(struct keyCache* cache) {
+   for (int i = 0; i < cache->numSlots; i++) {
+	cache->buckets[i] = EMPTYSLOT;
+	cache->slots[i].inUse = false;
+	cache->slots[i].pins = 0;
+	cache->blockNext[i] = i + 1 < cache->numSlots ? i + 1 : EMPTYSLOT;
+   }
+   for (int i = 0; i < MAXCONNECTIONS; i++) {
+	cache->pinnedSlot[i] = EMPTYSLOT;
+   }
+   cache->freeBlock = 0;
+   cache->numFree = cache->numSlots;
+   cache->resets++;
+}
+
+struct keyCache* createKeyCache(size_t memoryCap) {
+   size_t perSlot = KEYBLOCKSIZE + sizeof(struct keySlot) + 2 * sizeof(int);
+   if (memoryCap < sizeof(struct keyCache) + perSlot) {
+	return NULL;
+   }
+   int numSlots = (memoryCap - sizeof(struct keyCache)) / perSlot;
+
+   // Anonymous shared mapping, inherited by every forked child
+   char* region = mmap(NULL, memoryCap, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+   if (region == MAP_FAILED) error("ERROR mapping key cache");
+
+   struct keyCache* cache = (struct keyCache*)region;
+   cache->numSlots = numSlots;
+   cache->clockHand = 0;
+   cache->resets = 0;
+   cache->slots = (struct keySlot*)(region + sizeof(struct keyCache));
+   cache->buckets = (int*)(cache->slots + numSlots);
+   cache->blockNext = cache->buckets + numSlots;
+   cache->keys = (char*)(cache->blockNext + numSlots);
+   emptyCache(cache);
+
+   pthread_mutexattr_t attributes;
+   pthread_mutexattr_init(&attributes);
+   pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+   pthread_mutexattr_setrobust(&attributes, PTHREAD_MUTEX_ROBUST);  // Children can be killed while holding it
+   pthread_mutex_init(&cache->lock, &attributes);
+   pthread_mutexattr_destroy(&attributes);
+
+   return cache;
+}
+
+// Take the lock.  If its holder died mid-update, the chains can't be trusted, so start empty.
+static void lockCache(struct keyCache* cache) {
+   if (pthread_mutex_lock(&cache->lock) == EOWNERDEAD) {
+	emptyCache(cache);
+	pthread_mutex_consistent(&cache->lock);
+   }
+}
+
+static uint64_t rotl64(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+static uint64_t read64(const char* p) { uint64_t v; memcpy(&v, p, 8); return v; }
+
+static uint32_t read32(const char* p) { uint32_t v; memcpy(&v, p, 4); return v; }
+
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+static uint64_t xxhRound(uint64_t acc, uint64_t input) {
+   acc += input * PRIME64_2;
+   acc = rotl64(acc, 31);
+   return acc * PRIME64_1;
+}
+
+static uint64_t xxhMerge(uint64_t acc, uint64_t val) {
+   acc ^= xxhRound(0, val);
+   return acc * PRIME64_1 + PRIME64_4;
+}
+
+uint64_t keyDigest(const char* key, size_t length) {
+   const char* p = key;
+   const char* end = key + length;
+   uint64_t h;
+
+   // Four independent lanes over 32-byte stripes
+   if (length >= 32) {
+	uint64_t v1 = PRIME64_1 + PRIME64_2, v2 = PRIME64_2, v3 = 0, v4 = -PRIME64_1;
+	while (p + 32 <= end) {
+		v1 = xxhRound(v1, read64(p));
+		v2 = xxhRound(v2, read64(p + 8));
+		v3 = xxhRound(v3, read64(p + 16));
+		v4 = xxhRound(v4, read64(p + 24));
+		p += 32;
+	}
+	h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+	h = xxhMerge(h, v1);
+	h = xxhMerge(h, v2);
+	h = xxhMerge(h, v3);
+	h = xxhMerge(h, v4);
+   }
+   else {
+	h = PRIME64_5;
+   }
+   h += length;
+
+   // Tail
+   while (p + 8 <= end) {
+	h ^= xxhRound(0, read64(p));
+	h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+	p += 8;
+   }
+   if (p + 4 <= end) {
+	h ^= (uint64_t)read32(p) * PRIME64_1;
+	h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+	p += 4;
+   }
+   while (p < end) {
+	h ^= (uint64_t)(unsigned char)*p * PRIME64_5;
+	h = rotl64(h, 11) * PRIME64_1;
+	p++;
+   }
+
+   // Avalanche
+   h ^= h >> 33;
+   h *= PRIME64_2;
+   h ^= h >> 29;
+   h *= PRIME64_3;
+   h ^= h >> 32;
+   return h;
+}
+
+// Slot holding this key, or EMPTYSLOT.  Caller holds the lock.
+static int findSlot(struct keyCache* cache, uint64_t digest, size_t length) {
+   int slot = cache->buckets[digest % cache->numSlots];
+   while (slot != EMPTYSLOT) {
+	if (cache->slots[slot].digest == digest && cache->slots[slot].length == length) {
+		return slot;
+	}
+	slot = cache->slots[slot].bucketNext;
+   }
+   return EMPTYSLOT;
+}
+
+// Drop a pin taken by lookupKey.  Caller holds the lock.
+static void unpinSlot(struct keyCache* cache, int connection, int slot) {
+   cache->slots[slot].pins--;
+   if (connection >= 0) cache->pinnedSlot[connection] = EMPTYSLOT;
+}
+
+// Copy a cached key into a pool buffer, NULL on a miss
+static struct otpBuffer* lookupKey(struct keyCache* cache, uint64_t digest, size_t length) {
+   int connection = currentConnection != NULL ? currentConnection - connectionTable : -1;
+
+   // Pin the slot so its blocks stay put, then copy without the lock
+   lockCache(cache);
+   int slot = findSlot(cache, digest, length);
+   uint64_t resets = cache->resets;
+   if (slot != EMPTYSLOT) {
+	cache->slots[slot].referenced = true;
+	cache->slots[slot].pins++;
+	if (connection >= 0) cache->pinnedSlot[connection] = slot;
+   }
+   pthread_mutex_unlock(&cache->lock);
+   if (slot == EMPTYSLOT) return NULL;
+
+   struct otpBuffer* key = acquireBuffer(length + 1);
+   for (int block = cache->slots[slot].firstBlock; key->length < length; block = cache->blockNext[block]) {
+	size_t part = length - key->length < KEYBLOCKSIZE ? length - key->length : KEYBLOCKSIZE;
+	appendBuffer(key, cache->keys + (size_t)block * KEYBLOCKSIZE, part);
+   }
+   key->data[length] = '\0';
+
+   // An emptied cache already dropped the pin, and the blocks may hold another key by now
+   lockCache(cache);
+   if (cache->resets == resets) {
+	unpinSlot(cache, connection, slot);
+   }
+   else {
+	releaseBuffer(key);
+	key = NULL;
+   }
+   pthread_mutex_unlock(&cache->lock);
+
+   return key;
+}
+
+void releaseKeyPin(struct keyCache* cache, int connection) {
+   if (cache == NULL) return;
+
+   lockCache(cache);
+   if (cache->pinnedSlot[connection] != EMPTYSLOT) unpinSlot(cache, connection, cache->pinnedSlot[connection]);
+   pthread_mutex_unlock(&cache->lock);
+}
+
+// Unhook a slot from its bucket chain and free its blocks.  Caller holds the lock.
+static void evictSlot(struct keyCache* cache, int slot) {
+   int* link = &cache->buckets[cache->slots[slot].digest % cache->numSlots];
+   while (*link != slot) {
+	link = &cache->slots[*link].bucketNext;
+   }
+   *link = cache->slots[slot].bucketNext;
+
+   int block = cache->slots[slot].firstBlock;
+   while (block != EMPTYSLOT) {
+	int next = cache->blockNext[block];
+	cache->blockNext[block] = cache->freeBlock;
+	cache->freeBlock = block;
+	cache->numFree++;
+	block = next;
+   }
+   cache->slots[slot].inUse = false;
+}
+
+static void storeKey(struct keyCache* cache, uint64_t digest, const char* key, size_t length) {
+   size_t blocksNeeded = (length + KEYBLOCKSIZE - 1) / KEYBLOCKSIZE;
+   if (blocksNeeded > (size_t)cache->numSlots) {
+	return;  // Larger than the whole cache
+   }
+
+   lockCache(cache);
+
+   // Another child may have stored it while this one was receiving
+   if (findSlot(cache, digest, length) != EMPTYSLOT) {
+	pthread_mutex_unlock(&cache->lock);
+	return;
+   }
+
+   // CLOCK: evict slots not referenced since the last pass, clearing the rest as we go,
+   // until there is a free slot and enough free blocks.  Two passes evict everything unpinned,
+   // and if that is still not enough, pinned keys hold the space and this one is not stored.
+   int slot = EMPTYSLOT;
+   for (int steps = 0; slot == EMPTYSLOT || (size_t)cache->numFree < blocksNeeded; steps++) {
+	if (steps == 2 * cache->numSlots) {
+		pthread_mutex_unlock(&cache->lock);
+		return;
+	}
+	int hand = cache->clockHand;
+	cache->clockHand = (cache->clockHand + 1) % cache->numSlots;
+	if (cache->slots[hand].inUse) {
+		if (cache->slots[hand].pins > 0) continue;
+		if (cache->slots[hand].referenced) {
+			cache->slots[hand].referenced = false;
+			continue;
+		}
+		evictSlot(cache, hand);
+	}
+	if (slot == EMPTYSLOT) slot = hand;
+   }
+
+   // Take blocks off the free chain, copying as we go
+   int* link = &cache->slots[slot].firstBlock;
+   for (size_t offset = 0; offset < length; offset += KEYBLOCKSIZE) {
+	int block = cache->freeBlock;
+	cache->freeBlock = cache->blockNext[block];
+	cache->numFree--;
+	memcpy(cache->keys + (size_t)block * KEYBLOCKSIZE, key + offset, length - offset < KEYBLOCKSIZE ? length - offset : KEYBLOCKSIZE);
+	*link = block;
+	link = &cache->blockNext[block];
+   }
+   *link = EMPTYSLOT;
+
+   cache->slots[slot].digest = digest;
+   cache->slots[slot].length = length;
+   cache->slots[slot].inUse = true;
+   cache->slots[slot].referenced = false;
+   cache->slots[slot].pins = 0;
+   cache->slots[slot].bucketNext = cache->buckets[digest % cache->numSlots];
+   cache->buckets[digest % cache->numSlots] = slot;
+
+   pthread_mutex_unlock(&cache->lock);
+}
+
+void sendKey(int socketFD, const char* key, size_t length) {
+   char digestMessage[64];
+   int digestLength = snprintf(digestMessage, sizeof(digestMessage), "%016" PRIx64 " %zu", keyDigest(key, length), length);
+
+   sendMessage(socketFD, digestMessage, digestLength);
+   struct otpBuffer* reply = receiveMessage(socketFD, CLIENTACK);
+   if (strcmp(reply->data, "hit") != 0) {
+	sendMessage(socketFD, key, length);
+   }
+   releaseBuffer(reply);
+}
+
+struct otpBuffer* receiveKey(int communicationFD, struct keyCache* cache) {
+   uint64_t digest;
+   size_t length;
+   struct otpBuffer* key = NULL;
+
+   struct otpBuffer* digestMessage = receiveMessage(communicationFD, SERVERACK);
+   if (sscanf(digestMessage->data, "%" SCNx64 " %zu", &digest, &length) != 2) {
+	fprintf(stderr, "Malformed key digest\n");
+	exit(1);
+   }
+   releaseBuffer(digestMessage);
+
+   if (cache != NULL) {
+	key = lookupKey(cache, digest, length);
+   }
+   captureKey(digest, length, key != NULL);
+   if (key != NULL) {
+	sendMessage(communicationFD, "hit", 3);
+	return key;
+   }
+
+   sendMessage(communicationFD, "miss", 4);
+   key = receiveMessage(communicationFD, SERVERACK);
+
+   // Only cache what the client said it was sending
+   if (cache != NULL && key->length == length && keyDigest(key->data, key->length) == digest) {
+	storeKey(cache, digest, key->data, key->length);
+   }
+   return key;
+}
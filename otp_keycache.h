@@ -0,0 +1,39 @@
+/*******************************************************************************
+** Description: Shared-memory cache of recently uploaded keys. The daemon maps
+**              the cache before it starts forking, so every child sees the
+**              same entries. Keys are looked up by their XXH64 digest and
+**              length. Key bytes live in chains of KEYBLOCKSIZE blocks, so a
+**              small key costs one block and any key up to the size of the
+**              whole cache can be kept. When a key needs more blocks than are
+**              free, entries are evicted with the CLOCK policy until it fits.
+**              Clients send the digest first and upload the key only when the
+**              daemon answers "miss".
+*******************************************************************************/
+#ifndef OTP_KEYCACHE_H
+#define OTP_KEYCACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "otp_buffer.h"
+
+#define KEYBLOCKSIZE 4096         // Unit of key storage, a key takes as many as it fills
+#define DEFAULTCACHEMB 16         // Cache size when -k is not given
+
+struct keyCache;
+
+// Map a cache holding as many KEYBLOCKSIZE blocks as fit in memoryCap bytes, NULL if none fit
+struct keyCache* createKeyCache(size_t memoryCap);
+
+// XXH64 of the key bytes with a seed of zero
+uint64_t keyDigest(const char* key, size_t length);
+
+// Client side: offer the key's digest and upload the key only if the daemon misses
+void sendKey(int socketFD, const char* key, size_t length);
+
+// Daemon side: answer the digest from the cache or receive and store the key
+struct otpBuffer* receiveKey(int communicationFD, struct keyCache* cache);
+
+// Supervisor, on reaping the child of this connection slot: drop a pin it may have left
+void releaseKeyPin(struct keyCache* cache, int connection);
+
+#endif
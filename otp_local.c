@@ -0,0 +1,130 @@
+/*******************************************************************************
+** Description: Client file handling and local mode. Local mode makes two
+**              passes over the files. The first checks every symbol and
+**              measures both lengths, so a bad file prints nothing, just like
+**              the daemon path. The second rewinds and streams fixed-size
+**              blocks through the kernel to stdout.
+*******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include "otp_local.h"
+
+void error(const char *msg);  // Supplied by each program
+
+#define INVALIDTEXT ((size_t)-1)
+
+static int openTextFile(const char* path) {
+   int fd = open(path, O_RDONLY);
+
+   // Failed to open file
+   if (fd < 0) {
+	perror("Failed to open file!");
+	exit(1);
+   }
+   return fd;
+}
+
+struct otpBuffer* readTextFile(const char* path) {
+   int fd = openTextFile(path);
+   struct otpBuffer* text = acquireBuffer(LOCALBLOCKSIZE);
+   ssize_t numBytesRead;
+
+   do {
+	reserveBuffer(text, LOCALBLOCKSIZE);
+	numBytesRead = read(fd, text->data + text->length, LOCALBLOCKSIZE);
+	if (numBytesRead < 0) error("ERROR reading file");
+	text->length += numBytesRead;
+   } while (numBytesRead > 0);
+   close(fd);
+
+   if (text->length > 0 && text->data[text->length - 1] == '\n') {
+	text->length--;  // Trailing newline is not part of the message
+   }
+   return text;
+}
+
+// Text length without the trailing newline, or INVALIDTEXT if a byte is outside the alphabet
+static size_t measureTextFile(int fd, const struct alphabet* alphabet, char* block) {
+   size_t length = 0;
+   bool pendingNewline = false;
+   ssize_t numBytesRead;
+
+   while ((numBytesRead = read(fd, block, LOCALBLOCKSIZE)) > 0) {
+	// A newline is only allowed as the very last byte
+	if (pendingNewline) {
+		return INVALIDTEXT;
+	}
+	size_t valid = alphabet->validate(block, numBytesRead);
+	if (valid == (size_t)numBytesRead - 1 && block[valid] == '\n') {
+		pendingNewline = true;
+	}
+	else if (valid != (size_t)numBytesRead) {
+		return INVALIDTEXT;
+	}
+	length += valid;
+   }
+   if (numBytesRead < 0) error("ERROR reading file");
+
+   return length;
+}
+
+// Read exactly count bytes, the file must not have shrunk since it was measured
+static void readBlock(int fd, char* block, size_t count) {
+   size_t charsRead = 0;
+   while (charsRead < count) {
+	ssize_t numBytesRead = read(fd, block + charsRead, count - charsRead);
+	if (numBytesRead < 0) error("ERROR reading file");
+	if (numBytesRead == 0) {
+		fprintf(stderr, "File changed while reading!\n");
+		exit(1);
+	}
+	charsRead += numBytesRead;
+   }
+}
+
+void runLocal(const struct alphabet* alphabet, cipherKernel kernel, const char* messagePath, const char* keyPath) {
+   struct otpBuffer* messageBlock = acquireBuffer(LOCALBLOCKSIZE);
+   struct otpBuffer* keyBlock = acquireBuffer(LOCALBLOCKSIZE);
+   struct otpBuffer* outputBlock = acquireBuffer(LOCALBLOCKSIZE);
+   int message_fd = openTextFile(messagePath);
+   int key_fd = openTextFile(keyPath);
+
+   // First pass, same checks and messages as the daemon path
+   size_t messageLength = measureTextFile(message_fd, alphabet, messageBlock->data);
+   if (messageLength == INVALIDTEXT) {
+	fprintf(stderr, "Invalid character(s) found in %s file!\n", messagePath);
+	exit(1);
+   }
+   size_t keyLength = measureTextFile(key_fd, alphabet, keyBlock->data);
+   if (keyLength == INVALIDTEXT) {
+	fprintf(stderr, "Invalid character found in key!");
+	exit(1);
+   }
+   if (messageLength > keyLength) {
+	fprintf(stderr, "Error! Key length less than plaintext length!");
+	exit(1);
+   }
+
+   // Second pass, stream the message through the kernel
+   if (lseek(message_fd, 0, SEEK_SET) < 0 || lseek(key_fd, 0, SEEK_SET) < 0) error("ERROR rewinding file");
+   size_t remaining = messageLength;
+   while (remaining > 0) {
+	size_t blockLength = remaining < LOCALBLOCKSIZE ? remaining : LOCALBLOCKSIZE;
+	readBlock(message_fd, messageBlock->data, blockLength);
+	readBlock(key_fd, keyBlock->data, blockLength);
+	kernel(outputBlock->data, messageBlock->data, keyBlock->data, blockLength);
+	fwrite(outputBlock->data, 1, blockLength, stdout);
+	remaining -= blockLength;
+   }
+   printf("\n");
+
+   close(message_fd);
+   close(key_fd);
+   releaseBuffer(messageBlock);
+   releaseBuffer(keyBlock);
+   releaseBuffer(outputBlock);
+}
@@ -0,0 +1,25 @@
+/*******************************************************************************
+** Description: Client-side file handling shared by otp_enc and otp_dec. It
+**              holds the reader for the daemon path and the in-process local
+**              mode (-l). Local mode runs the same alphabet kernels as the
+**              daemons, but streams the message and key files straight to
+**              stdout. Both paths apply the same rules: one trailing newline
+**              is dropped, every symbol must be in the alphabet, and the key
+**              must be at least as long as the message. That keeps their
+**              output byte-identical.
+*******************************************************************************/
+#ifndef OTP_LOCAL_H
+#define OTP_LOCAL_H
+
+#include "otp_buffer.h"
+#include "otp_alphabet.h"
+
+#define LOCALBLOCKSIZE 65536  // Bytes read from each file per kernel call
+
+// Whole file in a pool buffer, without its trailing newline
+struct otpBuffer* readTextFile(const char* path);
+
+// Validate both files, then stream kernel(message, key) to stdout followed by a newline
+void runLocal(const struct alphabet* alphabet, cipherKernel kernel, const char* messagePath, const char* keyPath);
+
+#endif
@@ -0,0 +1,204 @@
+/*******************************************************************************
+** Description: Message transfer implementation. Partial sends and receives
+**              are retried until the expected count is reached, and a peer
+**              that closes the connection mid-message ends the process.
+*******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include "otp_message.h"
+#include "otp_connection.h"
+#include "otp_probes.h"
+#include "otp_crc32c.h"
+
+void error(const char *msg);  // Supplied by each program
+
+static void (*beforeChunkHook)(size_t length) = NULL;
+static void (*ackLateHook)(void) = NULL;
+static int ackWaitMs = 0;
+
+void setChunkHooks(void (*beforeChunk)(size_t length), void (*ackLate)(void), int waitMs) {
+   beforeChunkHook = beforeChunk;
+   ackLateHook = ackLate;
+   ackWaitMs = waitMs;
+}
+
+// Send exactly count bytes
+static void sendAll(int socketFD, const char* bytes, size_t count) {
+   size_t charsWritten = 0;
+   while (charsWritten < count) {
+	ssize_t sent = send(socketFD, bytes + charsWritten, count - charsWritten, 0);
+	if (sent < 0) error("ERROR writing to socket");
+	charsWritten += sent;
+	markActivity();
+   }
+}
+
+// Receive exactly count bytes
+static void receiveAll(int socketFD, char* bytes, size_t count) {
+   size_t charsRead = 0;
+   while (charsRead < count) {
+	ssize_t numBytesRead = recv(socketFD, bytes + charsRead, count - charsRead, 0);
+	if (numBytesRead < 0) error("ERROR reading from socket");
+	if (numBytesRead == 0) {
+		fprintf(stderr, "Connection closed mid-message\n");
+		exit(1);
+	}
+	charsRead += numBytesRead;
+	markActivity();
+   }
+}
+
+// Tell the hook when the peer is slow to answer a chunk, then take the answer whenever it comes
+static void receiveChunkReply(int socketFD, char* reply) {
+   if (ackLateHook != NULL) {
+	struct pollfd peer = { socketFD, POLLIN, 0 };
+	if (poll(&peer, 1, ackWaitMs) == 0) ackLateHook();
+   }
+   receiveAll(socketFD, reply, ACKSIZE);
+}
+
+void sendMessageHeader(int socketFD, size_t msgLength) {
+   char header[HEADERSIZE + 1];
+   char ackBuffer[ACKSIZE];
+
+   // Announce the length so the receiver can size its buffer up front
+   snprintf(header, sizeof(header), "%0*zu*", HEADERSIZE - 1, msgLength);
+   sendAll(socketFD, header, HEADERSIZE);
+   receiveAll(socketFD, ackBuffer, ACKSIZE);
+}
+
+void sendMessageChunks(int socketFD, const char* buffer, size_t length) {
+   char ackBuffer[ACKSIZE];
+   size_t charsWritten = 0;
+
+   while (charsWritten < length) {
+	size_t chunkLength = length - charsWritten;
+	if (chunkLength > MAXSENDSIZE) {
+		chunkLength = MAXSENDSIZE;
+	}
+	if (beforeChunkHook != NULL) beforeChunkHook(chunkLength);
+	sendAll(socketFD, buffer + charsWritten, chunkLength);
+	receiveChunkReply(socketFD, ackBuffer);
+	OTP_PROBE4(send_chunk, currentSerial, charsWritten, chunkLength, length);
+	charsWritten += chunkLength;
+   }
+}
+
+void sendMessage(int socketFD, const char* buffer, size_t msgLength) {
+   beginPhase(PHASEMESSAGE);
+   sendMessageHeader(socketFD, msgLength);
+   sendMessageChunks(socketFD, buffer, msgLength);
+   beginPhase(PHASEIDLE);
+}
+
+struct otpBuffer* receiveMessage(int communicationFD, const char* ack) {
+   char header[HEADERSIZE + 1];
+   size_t msgLength;
+
+   beginPhase(PHASEMESSAGE);
+   receiveAll(communicationFD, header, HEADERSIZE);
+   header[HEADERSIZE] = '\0';
+
+   // Digits only, since strtoull would take a sign and wrap a negative length around to a huge one
+   for (int i = 0; i < HEADERSIZE - 1; i++) {
+	if (!isdigit((unsigned char)header[i])) {
+		fprintf(stderr, "Malformed message header\n");
+		exit(1);
+	}
+   }
+   if (header[HEADERSIZE - 1] != '*') {
+	fprintf(stderr, "Malformed message header\n");
+	exit(1);
+   }
+   msgLength = strtoull(header, NULL, 10);
+   if (msgLength > MAXMESSAGESIZE) {
+	fprintf(stderr, "Message of %zu bytes is over the limit\n", msgLength);
+	exit(1);
+   }
+   sendAll(communicationFD, ack, ACKSIZE);
+
+   // One allocation sized to the message, plus a terminator for string handling
+   struct otpBuffer* buffer = acquireBuffer(msgLength + 1);
+   while (buffer->length < msgLength) {
+	size_t chunkLength = msgLength - buffer->length;
+	if (chunkLength > MAXSENDSIZE) {
+		chunkLength = MAXSENDSIZE;
+	}
+	receiveAll(communicationFD, buffer->data + buffer->length, chunkLength);
+	OTP_PROBE4(recv_chunk, currentSerial, buffer->length, chunkLength, msgLength);
+	buffer->length += chunkLength;
+	sendAll(communicationFD, ack, ACKSIZE);
+   }
+   buffer->data[buffer->length] = '\0';
+   beginPhase(PHASEIDLE);
+
+   return buffer;
+}
+
+void sendChecked(int socketFD, const char* buffer, size_t length) {
+   char chunk[MAXSENDSIZE + CHECKSUMSIZE + 1];
+   char reply[ACKSIZE];
+   size_t charsWritten = 0;
+   int retries = 0;
+
+   while (charsWritten < length) {
+	size_t chunkLength = length - charsWritten;
+	if (chunkLength > MAXSENDSIZE) {
+		chunkLength = MAXSENDSIZE;
+	}
+
+	// One write for chunk and checksum, so Nagle does not hold the checksum until the peer acks
+	memcpy(chunk, buffer + charsWritten, chunkLength);
+	snprintf(chunk + chunkLength, CHECKSUMSIZE + 1, "%08x", (unsigned)crc32c(0, buffer + charsWritten, chunkLength));
+	if (beforeChunkHook != NULL) beforeChunkHook(chunkLength);
+	sendAll(socketFD, chunk, chunkLength + CHECKSUMSIZE);
+	receiveChunkReply(socketFD, reply);
+
+	// The peer saw a different checksum, send the same chunk again
+	if (memcmp(reply, SERVERNAK, ACKSIZE) == 0 || memcmp(reply, CLIENTNAK, ACKSIZE) == 0) {
+		if (++retries > MAXCHUNKRETRIES) {
+			fprintf(stderr, "Chunk failed its checksum %d times\n", retries);
+			exit(1);
+		}
+		continue;
+	}
+	OTP_PROBE4(send_chunk, currentSerial, charsWritten, chunkLength, length);
+	charsWritten += chunkLength;
+	retries = 0;
+   }
+}
+
+void receiveChecked(int socketFD, char* buffer, size_t length, const char* ack, const char* nak) {
+   char checksum[CHECKSUMSIZE + 1];
+   char* checksumEnd;
+   size_t charsRead = 0;
+   int retries = 0;
+
+   while (charsRead < length) {
+	size_t chunkLength = length - charsRead;
+	if (chunkLength > MAXSENDSIZE) {
+		chunkLength = MAXSENDSIZE;
+	}
+	receiveAll(socketFD, buffer + charsRead, chunkLength);
+	receiveAll(socketFD, checksum, CHECKSUMSIZE);
+	checksum[CHECKSUMSIZE] = '\0';
+
+	if (strtoul(checksum, &checksumEnd, 16) != crc32c(0, buffer + charsRead, chunkLength) || checksumEnd != checksum + CHECKSUMSIZE) {
+		sendAll(socketFD, nak, ACKSIZE);
+		if (++retries > MAXCHUNKRETRIES) {
+			fprintf(stderr, "Chunk failed its checksum %d times\n", retries);
+			exit(1);
+		}
+		continue;
+	}
+	sendAll(socketFD, ack, ACKSIZE);
+	OTP_PROBE4(recv_chunk, currentSerial, charsRead, chunkLength, length);
+	charsRead += chunkLength;
+	retries = 0;
+   }
+}
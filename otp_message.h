@@ -0,0 +1,48 @@
+/*******************************************************************************
+** Description: Message transfer shared by the otp clients and daemons. A
+**              message is a fixed-width length header followed by the payload
+**              in chunks of up to MAXSENDSIZE bytes. The receiver answers the
+**              header and every chunk with a fixed-size ACK, so both ends
+**              always know exactly how many bytes to read next.
+*******************************************************************************/
+#ifndef OTP_MESSAGE_H
+#define OTP_MESSAGE_H
+
+#include <stddef.h>
+#include "otp_buffer.h"
+
+#define MAXSENDSIZE 1000
+#define HEADERSIZE 16  // Zero padded decimal length followed by '*'
+#define ACKSIZE 28     // Length of every ACK string
+#define MAXMESSAGESIZE ((size_t)1 << 32)  // Longest message a receiver will take, well inside the buffer pool
+#define CHECKSUMSIZE 8  // Hex CRC32C after each chunk of a checked stream
+#define MAXCHUNKRETRIES 3
+
+#define CLIENTTAG " client="     // Optional end of a request's first message, names the client for scheduling
+#define MAXCLIENTID 64
+
+#define SERVERACK "Server has received message\n"
+#define CLIENTACK "Client has received message\n"
+#define SERVERNAK "Server found a bad checksum\n"
+#define CLIENTNAK "Client found a bad checksum\n"
+
+// Send msgLength bytes, waiting for an ACK after the header and each chunk
+void sendMessage(int socketFD, const char* buffer, size_t msgLength);
+
+// The same in pieces: the header, then the body in runs that are whole chunks except the last
+void sendMessageHeader(int socketFD, size_t msgLength);
+void sendMessageChunks(int socketFD, const char* buffer, size_t length);
+
+// Receive one message into a pool buffer sized to it, sending ack after the header and each chunk
+struct otpBuffer* receiveMessage(int communicationFD, const char* ack);
+
+// A daemon child turns these on to schedule its sends. beforeChunk runs before every chunk of a message
+// body or checked stream goes out, and ackLate runs when its ACK is not back within ackWaitMs. NULLs turn them off.
+void setChunkHooks(void (*beforeChunk)(size_t length), void (*ackLate)(void), int ackWaitMs);
+
+// Checked streams, used by resumable transfers. There is no header, both ends already know the length.
+// Each chunk is followed by its CRC32C, and the receiver answers ack, or nak to have the chunk sent again.
+void sendChecked(int socketFD, const char* buffer, size_t length);
+void receiveChecked(int socketFD, char* buffer, size_t length, const char* ack, const char* nak);
+
+#endif
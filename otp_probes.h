@@ -0,0 +1,43 @@
+/*******************************************************************************
+** Description: USDT probes for attaching bpftrace or perf to a running daemon
+**              or client. They are placed whenever <sys/sdt.h> is found, and
+**              OTP_NO_USDT=1 bash compileall leaves them out. Each probe is a
+**              single nop until a tracer attaches, and its arguments are
+**              values already in hand. Left out, the probes compile to
+**              nothing and their arguments are never evaluated. Every probe
+**              is in provider "otp", and the first argument is always the
+**              connection id, currentSerial, which is 0 in the clients.
+**
+**              accept(id, pid, clientAddress)       supervisor, child forked
+**              auth(id, accepted)                   token checked, 1 or 0
+**              recv_chunk(id, offset, length, total)  message chunk received
+**              send_chunk(id, offset, length, total)  chunk sent and ACKed, offset
+**                                                     and total within the run sent
+**              cipher_start(id, offset, length)     kernel about to run
+**              cipher_end(id, offset, length)
+**              request_done(id, opcode, length)     reply sent in full, opcode as
+**                                                   in otp_capture.h
+**
+**              Sample scripts are in bpftrace/.
+*******************************************************************************/
+#ifndef OTP_PROBES_H
+#define OTP_PROBES_H
+
+#if !defined(OTP_NO_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define OTP_PROBES_ENABLED
+#endif
+#endif
+
+#ifdef OTP_PROBES_ENABLED
+#include <sys/sdt.h>
+#define OTP_PROBE2(name, a, b) DTRACE_PROBE2(otp, name, a, b)
+#define OTP_PROBE3(name, a, b, c) DTRACE_PROBE3(otp, name, a, b, c)
+#define OTP_PROBE4(name, a, b, c, d) DTRACE_PROBE4(otp, name, a, b, c, d)
+#else
+#define OTP_PROBE2(name, a, b) do { } while (0)
+#define OTP_PROBE3(name, a, b, c) do { } while (0)
+#define OTP_PROBE4(name, a, b, c, d) do { } while (0)
+#endif
+
+#endif
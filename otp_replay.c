@@ -0,0 +1,332 @@
+/*******************************************************************************
+** Description: The otp_replay program plays a capture written by a daemon's
+**              -T option back against otp_enc_d or otp_dec_d. Every captured
+**              connection is opened again by a forked child. The child sends
+**              a request with the same opcode, alphabet, and sizes, and
+**              pauses as long as the original client did between accept and
+**              request. Message symbols are generated from the connection
+**              serial, and key symbols from the key tag. A key that repeated
+**              in the capture therefore repeats in the replay, and the key
+**              cache sees the same hits. A resumable transfer is replayed as
+**              a transfer, run from the start in one attempt under an id of
+**              its own, so the daemon needs -S for those. Connections start
+**              at their original offsets by default. With -f they run back
+**              to back, at most -c at a time. A summary of request latencies
+**              is printed at the end.
+*******************************************************************************/
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "otp_buffer.h"
+#include "otp_message.h"
+#include "otp_keycache.h"
+#include "otp_alphabet.h"
+#include "otp_capture.h"
+#include "otp_transfer.h"
+
+#define MAXREPLAYCHILDREN 256
+#define DEFAULTCONCURRENCY 8      // Connections at once with -f
+
+struct replayResult {
+   uint32_t index;
+   uint32_t reserved;
+   uint64_t latency;              // Microseconds from connect to the last byte of the reply, less the client's pause
+};
+
+static int resultPipe[2];
+
+
+// Print error message
+void error(const char *msg) {
+   perror(msg);
+   exit(1);  // Counted as a failed request
+}
+
+static uint64_t nowUs(void) {
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static void sleepUntil(uint64_t deadline) {
+   uint64_t now = nowUs();
+   if (deadline <= now) return;
+
+   struct timespec pause = { (deadline - now) / 1000000, (deadline - now) % 1000000 * 1000 };
+   while (nanosleep(&pause, &pause) < 0 && errno == EINTR);
+}
+
+// splitmix64, so a seed always yields the same symbols
+static uint64_t nextRandom(uint64_t* state) {
+   uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+   z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+   z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+   return z ^ (z >> 31);
+}
+
+static struct otpBuffer* generateText(const struct alphabet* alphabet, size_t length, uint64_t seed) {
+   struct otpBuffer* text = acquireBuffer(length + 1);
+   for (size_t i = 0; i < length; i++) {
+	text->data[i] = alphabet->symbols[nextRandom(&seed) % alphabet->size];
+   }
+   text->length = length;
+   return text;
+}
+
+static int connectDaemon(int portNumber) {
+   struct sockaddr_in serverAddress;
+
+   memset((char*)&serverAddress, '\0', sizeof(serverAddress));
+   serverAddress.sin_family = AF_INET;
+   serverAddress.sin_port = htons(portNumber);
+   serverAddress.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+   int socketFD = socket(AF_INET, SOCK_STREAM, 0);
+   if (socketFD < 0) error("ERROR opening socket");
+   if (connect(socketFD, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) < 0) error("ERROR connecting");
+   int noDelay = 1;  // As in the clients, latencies would otherwise include Nagle's waits
+   setsockopt(socketFD, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+   return socketFD;
+}
+
+// Child side: a resumable transfer from the start, under an id no other replay child uses
+static void replayTransfer(int socketFD, const struct alphabet* alphabet, const struct otpBuffer* message, const struct otpBuffer* key) {
+   char request[192], transferId[32];
+   size_t length = message->length, textVerified, keyVerified;
+
+   snprintf(transferId, sizeof(transferId), "replay-%d", (int)getpid());
+   int requestLength = snprintf(request, sizeof(request), TRANSFERPREFIX "%s %s %zu 0 %016" PRIx64 " %016" PRIx64, transferId, alphabet->name, length,
+                                keyDigest(message->data, length), keyDigest(key->data, length));
+   sendMessage(socketFD, request, requestLength);
+
+   struct otpBuffer* reply = receiveMessage(socketFD, CLIENTACK);
+   if (sscanf(reply->data, "%zu %zu", &textVerified, &keyVerified) != 2 || textVerified != 0 || keyVerified != 0) {
+	fprintf(stderr, "Transfer %s refused: %s\n", transferId, reply->data);
+	exit(1);
+   }
+   releaseBuffer(reply);
+
+   sendChecked(socketFD, message->data, length);
+   sendChecked(socketFD, key->data, length);
+   reply = receiveMessage(socketFD, CLIENTACK);
+   if (strcmp(reply->data, "ok") != 0) {
+	fprintf(stderr, "Transfer %s refused: %s\n", transferId, reply->data);
+	exit(1);
+   }
+   releaseBuffer(reply);
+
+   // The output arrives in checkpoint runs, each one checked
+   struct otpBuffer* output = acquireBuffer(CHECKPOINTBYTES);
+   for (size_t offset = 0; offset < length; offset += CHECKPOINTBYTES) {
+	size_t runLength = length - offset < CHECKPOINTBYTES ? length - offset : CHECKPOINTBYTES;
+	receiveChecked(socketFD, output->data, runLength, CLIENTACK, CLIENTNAK);
+   }
+   releaseBuffer(output);
+   sendMessage(socketFD, "done", 4);
+}
+
+// Child side: one captured connection, opcode is the capture's daemon kind for records without a request
+static void replayConnection(const struct captureRecord* record, uint32_t index, int opcode, int portNumber, bool timed) {
+   char reply[100];
+   const char* token = opcode == CAPTUREDECRYPT ? "jambalaya" : "redWolf7";
+   uint64_t started = nowUs();
+
+   int socketFD = connectDaemon(portNumber);
+   if (record->flags & CAPTUREREJECTED) token = "replay";
+   if (send(socketFD, token, strlen(token) + 1, 0) < 0) error("ERROR writing to socket");
+   memset(reply, '\0', sizeof(reply));
+   if (recv(socketFD, reply, sizeof(reply) - 1, 0) < 0) error("ERROR reading from socket");
+   if ((record->flags & CAPTUREREJECTED) == 0 && strcmp(reply, "success") != 0) {
+	fprintf(stderr, "Connection %u was refused\n", record->connection);
+	exit(1);
+   }
+
+   // Closed before a request in the capture, so close here too
+   if (record->opcode != CAPTURENONE && (record->flags & CAPTUREREJECTED) == 0) {
+	const struct alphabet* alphabet = alphabetAt(record->alphabet);
+	if (alphabet == NULL) {
+		fprintf(stderr, "Connection %u uses an unknown alphabet\n", record->connection);
+		exit(1);
+	}
+	struct otpBuffer* message = generateText(alphabet, record->messageLength, record->connection);
+	struct otpBuffer* key = generateText(alphabet, record->keyLength, record->keyTag);
+
+	if (timed) {
+		uint64_t paused = nowUs();
+		sleepUntil(started + record->firstRequest);
+		started += nowUs() - paused;  // Time spent pausing is the client's
+	}
+	if (record->flags & CAPTURETRANSFER) {
+		replayTransfer(socketFD, alphabet, message, key);
+	}
+	else {
+		sendMessage(socketFD, alphabet->name, strlen(alphabet->name));
+		sendMessage(socketFD, message->data, message->length);
+		sendKey(socketFD, key->data, key->length);
+		releaseBuffer(receiveMessage(socketFD, CLIENTACK));
+	}
+   }
+   close(socketFD);
+
+   struct replayResult result = { index, 0, nowUs() - started };
+   if (write(resultPipe[1], &result, sizeof(result)) < 0) error("ERROR reporting result");
+}
+
+// Whole capture in memory, numRecords set to its length
+static struct captureRecord* readCapture(const char* path, size_t* numRecords) {
+   struct captureHeader header;
+   FILE* capture = fopen(path, "rb");
+   if (capture == NULL) error("ERROR opening capture");
+
+   if (fread(&header, sizeof(header), 1, capture) != 1 || memcmp(header.magic, CAPTUREMAGIC, sizeof(header.magic)) != 0 ||
+       header.recordSize != sizeof(struct captureRecord)) {
+	fprintf(stderr, "%s is not a capture this program can read\n", path);
+	exit(1);
+   }
+
+   size_t capacity = 1024;
+   struct captureRecord* records = malloc(capacity * sizeof(*records));
+   *numRecords = 0;
+   while (records != NULL && fread(&records[*numRecords], sizeof(*records), 1, capture) == 1) {
+	if (++*numRecords == capacity) {
+		capacity *= 2;
+		records = realloc(records, capacity * sizeof(*records));
+	}
+   }
+   if (records == NULL) error("ERROR reading capture");
+   fclose(capture);
+   return records;
+}
+
+// Records are appended as connections end, replay them in arrival order
+static int byArrival(const void* a, const void* b) {
+   const struct captureRecord *left = a, *right = b;
+   return (left->accepted > right->accepted) - (left->accepted < right->accepted);
+}
+
+static int byValue(const void* a, const void* b) {
+   uint64_t left = *(const uint64_t*)a, right = *(const uint64_t*)b;
+   return (left > right) - (left < right);
+}
+
+// Reap finished children, waiting for one if block is set. Returns how many were reaped.
+static int reapReplays(bool block, int* failed) {
+   int status, reaped = 0;
+   pid_t pid;
+
+   while ((pid = waitpid(-1, &status, block && reaped == 0 ? 0 : WNOHANG)) > 0) {
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) (*failed)++;
+	reaped++;
+   }
+   return reaped;
+}
+
+static void collectResults(uint64_t* latencies, size_t* numLatencies) {
+   struct replayResult result;
+   while (read(resultPipe[0], &result, sizeof(result)) == sizeof(result)) {
+	latencies[(*numLatencies)++] = result.latency;
+   }
+}
+
+static void usage(const char* program) {
+   fprintf(stderr,"USAGE: %s [-f] [-c concurrency] capture port\n", program);
+   exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+   bool timed = true;
+   int option, concurrency = DEFAULTCONCURRENCY, running = 0, failed = 0, late = 0;
+   int opcode = CAPTUREENCRYPT;
+   size_t numRecords, numLatencies = 0;
+
+   // -f replays back to back instead of at the captured offsets, -c caps connections at once with -f
+   while ((option = getopt(argc, argv, "fc:")) != -1) {
+	switch(option) {
+		case 'f':
+			timed = false;
+			break;
+		case 'c':
+			concurrency = atoi(optarg);
+			if (concurrency < 1 || concurrency > MAXREPLAYCHILDREN) usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+	}
+   }
+   if (argc - optind != 2) usage(argv[0]);
+   if (timed) concurrency = MAXREPLAYCHILDREN;
+
+   struct captureRecord* records = readCapture(argv[optind], &numRecords);
+   int portNumber = atoi(argv[optind + 1]);
+   qsort(records, numRecords, sizeof(*records), byArrival);
+   uint64_t* latencies = malloc((numRecords + 1) * sizeof(*latencies));
+   if (latencies == NULL) error("ERROR allocating results");
+
+   // A capture holds one daemon's traffic, so any request tells which token to use
+   for (size_t i = 0; i < numRecords; i++) {
+	if (records[i].opcode != CAPTURENONE) {
+		opcode = records[i].opcode;
+		break;
+	}
+   }
+
+   if (pipe(resultPipe) < 0) error("ERROR creating pipe");
+   fcntl(resultPipe[0], F_SETFL, O_NONBLOCK);
+   fflush(stdout);
+
+   uint64_t started = nowUs();
+   for (size_t i = 0; i < numRecords; i++) {
+	if (timed) {
+		uint64_t due = started + (records[i].accepted - records[0].accepted);
+		sleepUntil(due);
+		if (nowUs() > due + 10000) late++;  // Started more than 10 ms behind the capture
+	}
+	while (running >= concurrency) running -= reapReplays(true, &failed);
+
+	pid_t pid = fork();
+	switch(pid) {
+		case -1:
+			perror("Hull Breach!");
+			exit(1);
+
+		case 0:
+			close(resultPipe[0]);
+			replayConnection(&records[i], i, opcode, portNumber, timed);
+			exit(0);
+	}
+	running++;
+	running -= reapReplays(false, &failed);
+	collectResults(latencies, &numLatencies);
+   }
+   while (running > 0) running -= reapReplays(true, &failed);
+   collectResults(latencies, &numLatencies);
+   uint64_t elapsed = nowUs() - started;
+
+   // Summary
+   qsort(latencies, numLatencies, sizeof(*latencies), byValue);
+   printf("connections %zu  failed %d  late %d\n", numRecords, failed, late);
+   printf("elapsed %.3f s, captured span %.3f s\n", elapsed / 1e6,
+          numRecords > 0 ? (records[numRecords - 1].accepted - records[0].accepted) / 1e6 : 0.0);
+   if (numLatencies > 0) {
+	printf("latency us  p50 %llu  p90 %llu  p99 %llu  max %llu\n",
+	       (unsigned long long)latencies[numLatencies / 2], (unsigned long long)latencies[numLatencies * 9 / 10],
+	       (unsigned long long)latencies[numLatencies * 99 / 100], (unsigned long long)latencies[numLatencies - 1]);
+   }
+
+   free(latencies);
+   free(records);
+   return failed > 0;
+}
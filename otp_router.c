@@ -0,0 +1,599 @@
+/*******************************************************************************
+** Description: The otp_router program sits on one port in front of several
+**              otp_enc_d or otp_dec_d instances on local host, so clients
+**              keep a single port while the daemons behind it are scaled up
+**              or drained. Each new client goes to the healthy backend with
+**              the fewest outstanding requests. A forked child then relays
+**              bytes both ways until either side closes. Every connection
+**              carries exactly one request, so open relays are outstanding
+**              requests.
+**
+**              The router holds no token of its own. When a backend accepts
+**              a client's token, the router learns it and from then on keeps
+**              a small pool of backend connections per backend that are
+**              already authenticated with it. A client presenting the same
+**              token is answered by the router and handed a pooled
+**              connection, which skips the backend's handshake. Any other
+**              token is passed through to a fresh backend connection, so the
+**              backend still makes every real decision. Pooled connections
+**              are replaced before the daemons' idle deadline closes them.
+**              Each replacement doubles as a health check, and a backend
+**              that fails one gets no new clients until a later check
+**              passes. Replacements and checks connect without blocking and
+**              are moved along by the same poll as the listener, so a
+**              backend that hangs never delays a client bound elsewhere.
+*******************************************************************************/
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "otp_connection.h"
+
+#define MAXBACKENDS 16
+#define MAXPOOL 8
+#define MAXRELAYS 256
+#define TOKENSIZE 100             // Largest token a daemon will read
+#define RELAYBUFFERSIZE 65536
+#define ROUTERTICKMS 100
+#define DEFAULTPOOL 2             // Pre-authenticated connections per backend
+#define DEFAULTPOOLAGESECS 5      // Kept under the daemons' default idle deadline
+#define DEFAULTHEALTHSECS 2
+#define HANDSHAKEMS 5000          // Client token, or a backend's answer to one
+#define EXITBACKENDDOWN 2         // Relay child could not reach its backend
+
+#define ATTEMPTCONNECTING 0       // Waiting for connect to finish
+#define ATTEMPTAUTHENTICATING 1   // Token sent, waiting for the answer
+
+struct pooledConnection {
+   int fd;
+   uint64_t opened;
+};
+
+// A backend connection on its way into the pool, or a bare check that the backend is listening
+struct connectAttempt {
+   int fd;
+   int stage;
+   bool probeOnly;                // Closed once connected, no token is known yet
+   uint64_t started;
+};
+
+struct backend {
+   int port;
+   bool up;
+   int outstanding;                   // Open relays
+   uint64_t nextCheck;
+   int pooled;
+   struct pooledConnection pool[MAXPOOL];  // Oldest first
+   int attempts;
+   struct connectAttempt attempt[MAXPOOL];
+};
+
+// A descriptor the supervisor polls besides the listener and the token pipe
+struct watch {
+   int backend;
+   int fd;
+   bool attempt;                  // An attempt, otherwise a pooled connection
+};
+
+struct tokenReport {
+   int length;
+   char token[TOKENSIZE];
+};
+
+struct relay {
+   pid_t pid;                         // 0 when free
+   int backend;
+};
+
+static struct backend backends[MAXBACKENDS];
+static int numBackends = 0;
+static struct relay relays[MAXRELAYS];
+static int poolSize = DEFAULTPOOL;
+static uint64_t poolAgeMs = DEFAULTPOOLAGESECS * 1000;
+static uint64_t healthMs = DEFAULTHEALTHSECS * 1000;
+
+// Token the backends accepted most recently, length 0 until one has
+static char learnedToken[TOKENSIZE];
+static int learnedLength = 0;
+static int learnPipe[2];              // Relay children report accepted tokens here
+
+
+// Display error msg
+void error(const char *msg) { perror(msg); exit(1); } // Error function used for reporting issues
+
+static int createListener(int portNumber) {
+   struct sockaddr_in serverAddress;
+
+   memset((char *)&serverAddress, '\0', sizeof(serverAddress));
+   serverAddress.sin_family = AF_INET;
+   serverAddress.sin_port = htons(portNumber);
+   serverAddress.sin_addr.s_addr = INADDR_ANY;
+
+   int listenSocketFD = socket(AF_INET, SOCK_STREAM, 0);
+   if (listenSocketFD < 0) error("ERROR opening socket");
+   int reuse = 1;
+   setsockopt(listenSocketFD, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+   if (bind(listenSocketFD, (struct sockaddr *)&serverAddress, sizeof(serverAddress)) < 0) error("ERROR on binding");
+   listen(listenSocketFD, 5);
+
+   return listenSocketFD;
+}
+
+// Relayed bytes go out as they arrive, the endpoints already decide when to write
+static void setNoDelay(int socketFD) {
+   int noDelay = 1;
+   setsockopt(socketFD, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+}
+
+static void backendAddressFor(int portNumber, struct sockaddr_in* backendAddress) {
+   memset((char *)backendAddress, '\0', sizeof(*backendAddress));
+   backendAddress->sin_family = AF_INET;
+   backendAddress->sin_port = htons(portNumber);
+   backendAddress->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+}
+
+// Connect to a backend on local host, -1 when it is not there
+static int connectBackend(int portNumber) {
+   struct sockaddr_in backendAddress;
+
+   backendAddressFor(portNumber, &backendAddress);
+   int socketFD = socket(AF_INET, SOCK_STREAM, 0);
+   if (socketFD < 0) error("ERROR opening socket");
+   setNoDelay(socketFD);
+   if (connect(socketFD, (struct sockaddr *)&backendAddress, sizeof(backendAddress)) < 0) {
+	close(socketFD);
+	return -1;
+   }
+   return socketFD;
+}
+
+// One recv, giving up after timeoutMs. Returns the byte count, or -1 on timeout or error.
+static int receiveWithin(int socketFD, char* buffer, size_t size, int timeoutMs) {
+   struct pollfd peer = { socketFD, POLLIN, 0 };
+   if (poll(&peer, 1, timeoutMs) <= 0) return -1;
+   return recv(socketFD, buffer, size, 0);
+}
+
+// Send the whole buffer, false if the peer has gone
+static bool sendAll(int socketFD, const char* buffer, size_t length) {
+   while (length > 0) {
+	ssize_t charsWritten = send(socketFD, buffer, length, MSG_NOSIGNAL);
+	if (charsWritten < 0) {
+		if (errno == EINTR) continue;
+		return false;
+	}
+	buffer += charsWritten;
+	length -= charsWritten;
+   }
+   return true;
+}
+
+// Present token on a fresh backend connection, reply receives the backend's answer
+static bool authenticate(int backendFD, const char* token, int tokenLength, char* reply) {
+   memset(reply, '\0', TOKENSIZE);
+   if (!sendAll(backendFD, token, tokenLength)) return false;
+   if (receiveWithin(backendFD, reply, TOKENSIZE - 1, HANDSHAKEMS) <= 0) return false;
+   return strcmp(reply, "success") == 0;
+}
+
+/*******************************************************************************
+** Relay child
+*******************************************************************************/
+
+// Copy bytes both ways, passing each half-close on, until both sides are done
+static void pumpBytes(int clientFD, int backendFD) {
+   static char buffer[RELAYBUFFERSIZE];
+   struct pollfd ends[2] = { { clientFD, POLLIN, 0 }, { backendFD, POLLIN, 0 } };
+   int open = 2;
+
+   while (open > 0) {
+	if (poll(ends, 2, -1) < 0) {
+		if (errno == EINTR) continue;
+		error("ERROR polling relay");
+	}
+	for (int i = 0; i < 2; i++) {
+		if (ends[i].fd < 0 || ends[i].revents == 0) continue;
+
+		ssize_t charsRead = recv(ends[i].fd, buffer, sizeof(buffer), 0);
+		if (charsRead < 0 && errno == EINTR) continue;
+		if (charsRead <= 0) {
+			// Pass the close on, the other direction may still be moving
+			shutdown(ends[1 - i].fd, SHUT_WR);
+			ends[i].fd = -1;
+			open--;
+			continue;
+		}
+		if (!sendAll(ends[1 - i].fd, buffer, charsRead)) exit(0);  // A side reset, nothing left to relay
+	}
+   }
+}
+
+static void serveRelay(int clientFD, int backendFD, int portNumber) {
+   char token[TOKENSIZE], reply[TOKENSIZE];
+   int tokenLength;
+
+   // Receive the client's token the way the daemons do, in one recv
+   memset(token, '\0', sizeof(token));
+   tokenLength = receiveWithin(clientFD, token, sizeof(token) - 1, HANDSHAKEMS);
+   if (tokenLength <= 0) exit(0);
+
+   // A pooled connection already passed this exact token
+   if (backendFD >= 0 && tokenLength == learnedLength && memcmp(token, learnedToken, tokenLength) == 0) {
+	if (!sendAll(clientFD, "success", 7)) exit(0);
+   }
+   else {
+	if (backendFD >= 0) close(backendFD);
+	backendFD = connectBackend(portNumber);
+	if (backendFD < 0) exit(EXITBACKENDDOWN);
+
+	bool accepted = authenticate(backendFD, token, tokenLength, reply);
+	if (reply[0] == '\0') exit(EXITBACKENDDOWN);  // No answer at all
+	if (!sendAll(clientFD, reply, strlen(reply)) || !accepted) exit(0);
+
+	// Tell the supervisor, so it can pool connections for the next client
+	if (tokenLength != learnedLength || memcmp(token, learnedToken, tokenLength) != 0) {
+		struct tokenReport report;
+		report.length = tokenLength;
+		memcpy(report.token, token, sizeof(token));
+		if (write(learnPipe[1], &report, sizeof(report)) < 0) error("ERROR reporting token");  // Under PIPE_BUF, so never interleaved
+	}
+   }
+
+   pumpBytes(clientFD, backendFD);
+}
+
+/*******************************************************************************
+** Supervisor
+*******************************************************************************/
+
+static void closePooled(struct backend* backend, int index) {
+   close(backend->pool[index].fd);
+   backend->pooled--;
+   memmove(&backend->pool[index], &backend->pool[index + 1], (backend->pooled - index) * sizeof(backend->pool[0]));
+}
+
+static void removeAttempt(struct backend* backend, int index) {
+   backend->attempts--;
+   memmove(&backend->attempt[index], &backend->attempt[index + 1], (backend->attempts - index) * sizeof(backend->attempt[0]));
+}
+
+static void closeAttempt(struct backend* backend, int index) {
+   close(backend->attempt[index].fd);
+   removeAttempt(backend, index);
+}
+
+static void markDown(struct backend* backend, uint64_t now) {
+   if (backend->up) fprintf(stderr, "Backend on port %d is down\n", backend->port);
+   backend->up = false;
+   backend->nextCheck = now + healthMs;
+   while (backend->pooled > 0) closePooled(backend, backend->pooled - 1);
+   while (backend->attempts > 0) closeAttempt(backend, backend->attempts - 1);
+}
+
+static void markUp(struct backend* backend, uint64_t now) {
+   if (!backend->up) fprintf(stderr, "Backend on port %d is up\n", backend->port);
+   backend->up = true;
+   backend->nextCheck = now + healthMs;
+}
+
+// Start connecting without waiting for it, false if the backend refused at once
+static bool startAttempt(struct backend* backend, bool probeOnly, uint64_t now) {
+   struct sockaddr_in backendAddress;
+
+   backendAddressFor(backend->port, &backendAddress);
+   int socketFD = socket(AF_INET, SOCK_STREAM, 0);
+   if (socketFD < 0) error("ERROR opening socket");
+   setNoDelay(socketFD);
+   fcntl(socketFD, F_SETFL, O_NONBLOCK);
+   if (connect(socketFD, (struct sockaddr *)&backendAddress, sizeof(backendAddress)) < 0 && errno != EINPROGRESS) {
+	close(socketFD);
+	return false;
+   }
+
+   struct connectAttempt* attempt = &backend->attempt[backend->attempts++];
+   attempt->fd = socketFD;
+   attempt->stage = ATTEMPTCONNECTING;
+   attempt->probeOnly = probeOnly;
+   attempt->started = now;
+   return true;
+}
+
+// Move an attempt along once poll reports its socket ready
+static void advanceAttempt(struct backend* backend, int index, uint64_t now) {
+   struct connectAttempt* attempt = &backend->attempt[index];
+   char reply[TOKENSIZE];
+
+   if (attempt->stage == ATTEMPTCONNECTING) {
+	int socketError = 0;
+	socklen_t errorSize = sizeof(socketError);
+	if (getsockopt(attempt->fd, SOL_SOCKET, SO_ERROR, &socketError, &errorSize) < 0 || socketError != 0) {
+		markDown(backend, now);
+		return;
+	}
+	if (attempt->probeOnly) {
+		closeAttempt(backend, index);
+		markUp(backend, now);
+		return;
+	}
+
+	// A token fits in a fresh socket's send buffer, so one send takes all of it
+	if (send(attempt->fd, learnedToken, learnedLength, MSG_NOSIGNAL) != learnedLength) {
+		markDown(backend, now);
+		return;
+	}
+	attempt->stage = ATTEMPTAUTHENTICATING;
+	return;
+   }
+
+   // The daemons answer a token in one send, as serveRelay expects too
+   memset(reply, '\0', sizeof(reply));
+   ssize_t charsRead = recv(attempt->fd, reply, sizeof(reply) - 1, 0);
+   if (charsRead < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return;
+   if (charsRead <= 0 || strcmp(reply, "success") != 0) {
+	markDown(backend, now);
+	return;
+   }
+
+   // Relay children use pooled connections with blocking calls
+   fcntl(attempt->fd, F_SETFL, 0);
+   backend->pool[backend->pooled].fd = attempt->fd;
+   backend->pool[backend->pooled].opened = now;
+   backend->pooled++;
+   removeAttempt(backend, index);
+   markUp(backend, now);
+}
+
+static void maintainBackends(uint64_t now) {
+   for (int i = 0; i < numBackends; i++) {
+	struct backend* backend = &backends[i];
+
+	// Retire pooled connections before the backend's idle deadline does
+	while (backend->pooled > 0 && backend->pool[0].opened + poolAgeMs <= now) closePooled(backend, 0);
+
+	// An attempt the backend has not finished within the handshake time fails the check
+	for (int j = 0; j < backend->attempts; j++) {
+		if (backend->attempt[j].started + HANDSHAKEMS <= now) {
+			markDown(backend, now);
+			break;
+		}
+	}
+
+	// A down backend gets one check at a time.  Before any token is known, accepting a connection counts as up.
+	if (!backend->up) {
+		if (backend->attempts > 0 || now < backend->nextCheck) continue;
+		if (!startAttempt(backend, learnedLength == 0 || poolSize == 0, now)) backend->nextCheck = now + healthMs;
+		continue;
+	}
+
+	// Refilling the pool checks the backend, only an empty pool needs a separate probe
+	if (learnedLength > 0) {
+		while (backend->pooled + backend->attempts < poolSize) {
+			if (!startAttempt(backend, false, now)) {
+				markDown(backend, now);
+				break;
+			}
+		}
+	}
+	if (backend->up && backend->pooled == 0 && backend->attempts == 0 && now >= backend->nextCheck) {
+		if (!startAttempt(backend, true, now)) markDown(backend, now);
+		else backend->nextCheck = now + healthMs;
+	}
+   }
+}
+
+// Position of fd among a backend's attempts or pooled connections, -1 if it has gone
+static int findAttempt(struct backend* backend, int fd) {
+   for (int i = 0; i < backend->attempts; i++) {
+	if (backend->attempt[i].fd == fd) return i;
+   }
+   return -1;
+}
+
+static int findPooled(struct backend* backend, int fd) {
+   for (int i = 0; i < backend->pooled; i++) {
+	if (backend->pool[i].fd == fd) return i;
+   }
+   return -1;
+}
+
+// Healthy backend with the fewest outstanding requests, ties taken in turn, -1 if none is up.
+// One whose pool ran dry while refills are pending has not answered lately, so any with a
+// pooled connection goes first.
+static bool ready(const struct backend* backend) {
+   return backend->pooled > 0 || backend->attempts == 0;
+}
+
+static int pickBackend(void) {
+   static int nextStart = 0;
+   int best = -1;
+
+   for (int n = 0; n < numBackends; n++) {
+	int i = (nextStart + n) % numBackends;
+	if (!backends[i].up) continue;
+	if (best < 0 || ready(&backends[i]) > ready(&backends[best]) ||
+	    (ready(&backends[i]) == ready(&backends[best]) && backends[i].outstanding < backends[best].outstanding)) best = i;
+   }
+   nextStart = (nextStart + 1) % numBackends;
+   return best;
+}
+
+static struct relay* freeRelay(void) {
+   for (int i = 0; i < MAXRELAYS; i++) {
+	if (relays[i].pid == 0) return &relays[i];
+   }
+   return NULL;
+}
+
+static void reapRelays(uint64_t now) {
+   pid_t pid;
+   int status;
+
+   while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+	for (int i = 0; i < MAXRELAYS; i++) {
+		if (relays[i].pid != pid) continue;
+		struct backend* backend = &backends[relays[i].backend];
+		backend->outstanding--;
+		if (WIFEXITED(status) && WEXITSTATUS(status) == EXITBACKENDDOWN) markDown(backend, now);
+		relays[i].pid = 0;
+		break;
+	}
+   }
+}
+
+// Take in tokens reported by relay children. A new token empties the pools, which were authenticated with the old one.
+static void readLearnedTokens(void) {
+   struct tokenReport report;
+
+   while (read(learnPipe[0], &report, sizeof(report)) == sizeof(report)) {
+	if (report.length == learnedLength && memcmp(report.token, learnedToken, learnedLength) == 0) continue;
+
+	memcpy(learnedToken, report.token, sizeof(report.token));
+	learnedLength = report.length;
+	for (int i = 0; i < numBackends; i++) {
+		while (backends[i].pooled > 0) closePooled(&backends[i], backends[i].pooled - 1);
+		while (backends[i].attempts > 0) closeAttempt(&backends[i], backends[i].attempts - 1);
+	}
+   }
+}
+
+static void acceptClient(int listenSocketFD) {
+   int establishedConnectionFD = accept(listenSocketFD, NULL, NULL);
+   if (establishedConnectionFD < 0) error("ERROR on accept");
+   setNoDelay(establishedConnectionFD);
+
+   int chosen = pickBackend();
+   struct relay* relay = freeRelay();
+   if (chosen < 0 || relay == NULL) {
+	fprintf(stderr, chosen < 0 ? "No backend is up, refusing a connection\n" : "Too many open connections, refusing one\n");
+	close(establishedConnectionFD);
+	return;
+   }
+
+   // Hand over the oldest pooled connection, it is the nearest to being retired
+   struct backend* backend = &backends[chosen];
+   int backendFD = -1;
+   if (backend->pooled > 0) {
+	backendFD = backend->pool[0].fd;
+	backend->pooled--;
+	memmove(&backend->pool[0], &backend->pool[1], backend->pooled * sizeof(backend->pool[0]));
+   }
+
+   pid_t pid = fork();
+   switch(pid) {
+	case -1:
+		perror("Hull Breach!");
+		exit(1);
+
+	case 0:
+		// Only the supervisor may hold pooled connections, or closing them would not reach the backend
+		close(listenSocketFD);
+		close(learnPipe[0]);
+		for (int i = 0; i < numBackends; i++) {
+			for (int j = 0; j < backends[i].pooled; j++) close(backends[i].pool[j].fd);
+			for (int j = 0; j < backends[i].attempts; j++) close(backends[i].attempt[j].fd);
+		}
+		serveRelay(establishedConnectionFD, backendFD, backend->port);
+		exit(0);
+   }
+   relay->pid = pid;
+   relay->backend = chosen;
+   backend->outstanding++;
+   close(establishedConnectionFD);
+   if (backendFD >= 0) close(backendFD);
+}
+
+static void usage(const char* program) {
+   fprintf(stderr,"USAGE: %s [-p poolSize] [-A poolAgeSecs] [-h healthSecs] port backendPort...\n", program);
+   exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+   struct pollfd fds[2 + 2 * MAXBACKENDS * MAXPOOL];
+   struct watch watches[2 * MAXBACKENDS * MAXPOOL];
+   int option, listenSocketFD;
+
+   // -p sets the pool kept per backend, -A how long a pooled connection is kept,
+   // -h how often a backend with nothing pooled is checked
+   while ((option = getopt(argc, argv, "p:A:h:")) != -1) {
+	switch(option) {
+		case 'p':
+			poolSize = atoi(optarg);
+			if (poolSize < 0 || poolSize > MAXPOOL) usage(argv[0]);
+			break;
+		case 'A':
+			poolAgeMs = (uint64_t)atoi(optarg) * 1000;
+			break;
+		case 'h':
+			healthMs = (uint64_t)atoi(optarg) * 1000;
+			break;
+		default:
+			usage(argv[0]);
+	}
+   }
+   if (argc - optind < 2 || argc - optind - 1 > MAXBACKENDS) usage(argv[0]);
+
+   for (int i = optind + 1; i < argc; i++) {
+	backends[numBackends].port = atoi(argv[i]);
+	numBackends++;  // Down until the first check, which is due now
+   }
+
+   if (pipe(learnPipe) < 0) error("ERROR creating pipe");
+   fcntl(learnPipe[0], F_SETFL, O_NONBLOCK);
+   listenSocketFD = createListener(atoi(argv[optind]));
+   maintainBackends(monotonicMs());
+
+   while(1) {
+	// The listener, token reports, every pooled connection, which should stay silent, and every attempt
+	int numFDs = 2, numWatched = 0;
+	fds[0] = (struct pollfd){ listenSocketFD, POLLIN, 0 };
+	fds[1] = (struct pollfd){ learnPipe[0], POLLIN, 0 };
+	for (int i = 0; i < numBackends; i++) {
+		for (int j = 0; j < backends[i].pooled; j++) {
+			fds[numFDs++] = (struct pollfd){ backends[i].pool[j].fd, POLLIN, 0 };
+			watches[numWatched++] = (struct watch){ i, backends[i].pool[j].fd, false };
+		}
+		for (int j = 0; j < backends[i].attempts; j++) {
+			short events = backends[i].attempt[j].stage == ATTEMPTCONNECTING ? POLLOUT : POLLIN;
+			fds[numFDs++] = (struct pollfd){ backends[i].attempt[j].fd, events, 0 };
+			watches[numWatched++] = (struct watch){ i, backends[i].attempt[j].fd, true };
+		}
+	}
+
+	int ready = poll(fds, numFDs, ROUTERTICKMS);
+	if (ready < 0 && errno != EINTR) error("ERROR polling");
+	uint64_t now = monotonicMs();
+
+	// A pooled connection that turns readable was closed by its backend.  Entries are found again by
+	// descriptor, since a failed attempt closes everything its backend holds.
+	if (ready > 0) {
+		for (int w = 0; w < numWatched; w++) {
+			if (fds[2 + w].revents == 0) continue;
+			struct backend* backend = &backends[watches[w].backend];
+			int index = watches[w].attempt ? findAttempt(backend, watches[w].fd) : findPooled(backend, watches[w].fd);
+			if (index < 0) continue;
+			if (watches[w].attempt) advanceAttempt(backend, index, now);
+			else closePooled(backend, index);
+		}
+		if (fds[1].revents != 0) readLearnedTokens();
+		if (fds[0].revents != 0) acceptClient(listenSocketFD);
+	}
+
+	reapRelays(now);
+	maintainBackends(now);
+   }
+
+   close(listenSocketFD);
+
+   return 0;
+}
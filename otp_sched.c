@@ -0,0 +1,361 @@
+/*******************************************************************************
+** Description: Scheduler implementation. The shared state is one record per
+**              connection slot (what it waits for or holds) and one record
+**              per client (weight and deficit). Client keys keep the three
+**              kinds of client apart: an address is below 2^32, a single
+**              connection has bit 32 set, and a named client has bit 63 set. Queue heads and bytes in
+**              flight are recomputed from the connection records on every
+**              dispatch. So if a child dies mid-update, the worst it can
+**              leave behind is a stale deficit. The supervisor clears a dead
+**              child's record when it reaps it. A scheduled send tracks
+**              whether it holds a grant in the child alone, and hooks the
+**              message chunks (otp_message.h) to take one before a chunk
+**              goes out and give it up when the ACK runs late.
+*******************************************************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include "otp_sched.h"
+#include "otp_connection.h"
+
+void error(const char *msg);  // Supplied by each program
+
+#define WAITERIDLE 0
+#define WAITERQUEUED 1
+#define WAITERGRANTED 2
+#define NOWAITER -1
+
+struct schedWaiter {
+   sem_t granted;       // Posted once the dispatcher grants this request
+   int state;
+   int client;          // Index into clients
+   size_t bytes;
+   uint64_t sequence;   // Arrival order, queues are FIFO per client
+};
+
+#define CONNECTIONCLIENT (1ULL << 32)
+#define NAMEDCLIENT (1ULL << 63)
+
+struct schedClient {
+   uint64_t key;
+   int weight;
+   bool inUse;
+   bool turnStarted;    // Quantum already added for the current round
+   size_t deficit;
+};
+
+struct scheduler {
+   pthread_mutex_t lock;
+   int grants;
+   size_t inflightCap;
+   int cursor;          // Client whose round it is
+   uint64_t nextSequence;
+   struct schedClient clients[MAXCONNECTIONS];
+   struct schedWaiter waiters[MAXCONNECTIONS];
+};
+
+static struct scheduler* scheduler = NULL;
+static struct { uint64_t key; int weight; } weightRules[MAXWEIGHTRULES];
+static int numWeightRules = 0;
+static int slotsPerClient = MAXCONNECTIONS;
+static bool holdingGrant = false;  // Child side, during a scheduled send
+
+void createScheduler(int grants, size_t inflightCap, int clientSlots) {
+   scheduler = mmap(NULL, sizeof(struct scheduler), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+   if (scheduler == MAP_FAILED) error("ERROR mapping scheduler");
+   memset(scheduler, '\0', sizeof(struct scheduler));
+
+   scheduler->grants = grants > 0 ? grants : (int)sysconf(_SC_NPROCESSORS_ONLN);
+   scheduler->inflightCap = inflightCap;
+   slotsPerClient = clientSlots > 0 ? clientSlots : MAXCONNECTIONS;
+   for (int i = 0; i < MAXCONNECTIONS; i++) {
+	sem_init(&scheduler->waiters[i].granted, 1, 0);
+   }
+
+   pthread_mutexattr_t attributes;
+   pthread_mutexattr_init(&attributes);
+   pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+   pthread_mutexattr_setrobust(&attributes, PTHREAD_MUTEX_ROBUST);
+   pthread_mutex_init(&scheduler->lock, &attributes);
+   pthread_mutexattr_destroy(&attributes);
+}
+
+// FNV-1a of the id, tagged so it cannot meet an address or connection key
+static uint64_t namedKey(const char* clientId, size_t length) {
+   uint64_t hash = 0xCBF29CE484222325ULL;
+   for (size_t i = 0; i < length; i++) {
+	hash = (hash ^ (unsigned char)clientId[i]) * 0x100000001B3ULL;
+   }
+   return hash | NAMEDCLIENT;
+}
+
+static bool validClientId(const char* clientId, size_t length) {
+   if (length == 0 || length > MAXCLIENTID) return false;
+   for (size_t i = 0; i < length; i++) {
+	if (!isalnum((unsigned char)clientId[i]) && clientId[i] != '-' && clientId[i] != '_') return false;
+   }
+   return true;
+}
+
+int addClientWeight(const char* rule) {
+   char name[MAXCLIENTID + 1];
+   int weight;
+   struct in_addr parsed;
+
+   if (numWeightRules == MAXWEIGHTRULES || sscanf(rule, "%64[^=]=%d", name, &weight) != 2 || weight < 1) {
+	return 0;
+   }
+   if (inet_pton(AF_INET, name, &parsed) == 1) {
+	weightRules[numWeightRules].key = parsed.s_addr;
+   }
+   else if (validClientId(name, strlen(name))) {
+	weightRules[numWeightRules].key = namedKey(name, strlen(name));
+   }
+   else {
+	return 0;
+   }
+   weightRules[numWeightRules].weight = weight;
+   numWeightRules++;
+   return 1;
+}
+
+uint64_t peerClient(uint32_t address, uint32_t serial) {
+   // Everything local arrives from 127.0.0.0/8, so the address tells nothing apart there
+   if ((ntohl(address) >> 24) == 127) {
+	return CONNECTIONCLIENT | serial;
+   }
+   return address;
+}
+
+// Connections open for a client, other than the one asking
+static int clientConnections(uint64_t client, const struct connectionSlot* asking) {
+   int open = 0;
+   for (int i = 0; i < MAXCONNECTIONS; i++) {
+	if (&connectionTable[i] != asking && connectionTable[i].pid != 0 && connectionTable[i].client == client) {
+		open++;
+	}
+   }
+   return open;
+}
+
+int admitClient(const struct connectionSlot* slot) {
+   return clientConnections(slot->client, slot) < slotsPerClient;
+}
+
+void nameClient(struct otpBuffer* request) {
+   char* tag = strstr(request->data, CLIENTTAG);
+   if (tag == NULL) {
+	return;
+   }
+   const char* clientId = tag + strlen(CLIENTTAG);
+   size_t length = request->length - (clientId - request->data);
+   if (validClientId(clientId, length) && currentConnection != NULL) {
+	// Local connections are only told apart once they name themselves, so their share is checked here
+	currentConnection->client = namedKey(clientId, length);
+	if (!admitClient(currentConnection)) {
+		fprintf(stderr, "Client %.*s already has %d connections open\n", (int)length, clientId, slotsPerClient);
+		exit(1);
+	}
+   }
+
+   // Whatever follows the tag is not part of the request
+   *tag = '\0';
+   request->length = tag - request->data;
+}
+
+// Everything derived from the waiters is rebuilt on dispatch, so a dead holder needs no repair
+static void lockScheduler(void) {
+   if (pthread_mutex_lock(&scheduler->lock) == EOWNERDEAD) {
+	pthread_mutex_consistent(&scheduler->lock);
+   }
+}
+
+// Client record for a key, reusing one no connection refers to if it is new
+static int clientFor(uint64_t key) {
+   bool referenced[MAXCONNECTIONS] = { false };
+   int freeClient = NOWAITER;
+
+   for (int i = 0; i < MAXCONNECTIONS; i++) {
+	if (scheduler->clients[i].inUse && scheduler->clients[i].key == key) {
+		return i;
+	}
+	if (scheduler->waiters[i].state != WAITERIDLE) {
+		referenced[scheduler->waiters[i].client] = true;
+	}
+   }
+   for (int i = 0; i < MAXCONNECTIONS && freeClient == NOWAITER; i++) {
+	if (!referenced[i]) {
+		freeClient = i;
+	}
+   }
+
+   // One connection refers to at most one client, so there is always a free record
+   struct schedClient* client = &scheduler->clients[freeClient];
+   client->key = key;
+   client->weight = 1;
+   for (int i = 0; i < numWeightRules; i++) {
+	if (weightRules[i].key == key) {
+		client->weight = weightRules[i].weight;
+	}
+   }
+   client->inUse = true;
+   client->turnStarted = false;
+   client->deficit = 0;
+   return freeClient;
+}
+
+// Oldest queued request of a client
+static int queueHead(int client) {
+   int head = NOWAITER;
+   for (int i = 0; i < MAXCONNECTIONS; i++) {
+	struct schedWaiter* waiter = &scheduler->waiters[i];
+	if (waiter->state == WAITERQUEUED && waiter->client == client &&
+	    (head == NOWAITER || waiter->sequence < scheduler->waiters[head].sequence)) {
+		head = i;
+	}
+   }
+   return head;
+}
+
+static void nextTurn(void) {
+   scheduler->clients[scheduler->cursor].turnStarted = false;
+   scheduler->cursor = (scheduler->cursor + 1) % MAXCONNECTIONS;
+}
+
+// Deficit round-robin: hand out free grants until every waiting client is out of deficit or capped
+static void dispatch(void) {
+   int outstanding = 0;
+   size_t inflight[MAXCONNECTIONS] = { 0 };
+   int idleTurns = 0;
+
+   for (int i = 0; i < MAXCONNECTIONS; i++) {
+	if (scheduler->waiters[i].state == WAITERGRANTED) {
+		outstanding++;
+		inflight[scheduler->waiters[i].client] += scheduler->waiters[i].bytes;
+	}
+   }
+
+   while (outstanding < scheduler->grants && idleTurns <= MAXCONNECTIONS) {
+	int current = scheduler->cursor;
+	struct schedClient* client = &scheduler->clients[current];
+	int head = queueHead(current);
+
+	// Nothing queued, an idle client keeps no credit
+	if (head == NOWAITER) {
+		client->deficit = 0;
+		nextTurn();
+		idleTurns++;
+		continue;
+	}
+
+	struct schedWaiter* waiter = &scheduler->waiters[head];
+	bool capped = inflight[current] > 0 && inflight[current] + waiter->bytes > scheduler->inflightCap;
+	if (!capped && !client->turnStarted) {
+		client->deficit += (size_t)SCHEDQUANTUM * client->weight;
+		client->turnStarted = true;
+	}
+	if (!capped && waiter->bytes <= client->deficit) {
+		client->deficit -= waiter->bytes;
+		inflight[current] += waiter->bytes;
+		waiter->state = WAITERGRANTED;
+		sem_post(&waiter->granted);
+		outstanding++;
+		idleTurns = 0;
+		continue;
+	}
+
+	nextTurn();
+	idleTurns++;
+   }
+}
+
+void acquireGrant(int connection, uint64_t client, size_t bytes) {
+   if (scheduler == NULL) {
+	return;
+   }
+   struct schedWaiter* waiter = &scheduler->waiters[connection];
+
+   lockScheduler();
+   waiter->client = clientFor(client);
+   waiter->bytes = bytes;
+   waiter->sequence = scheduler->nextSequence++;
+   waiter->state = WAITERQUEUED;
+   dispatch();
+   pthread_mutex_unlock(&scheduler->lock);
+
+   while (sem_wait(&waiter->granted) < 0) {
+	if (errno != EINTR) error("ERROR waiting for grant");
+   }
+}
+
+void releaseGrant(int connection) {
+   if (scheduler == NULL) {
+	return;
+   }
+   lockScheduler();
+   scheduler->waiters[connection].state = WAITERIDLE;
+   dispatch();
+   pthread_mutex_unlock(&scheduler->lock);
+}
+
+void forgetConnection(int connection) {
+   if (scheduler == NULL) {
+	return;
+   }
+   struct schedWaiter* waiter = &scheduler->waiters[connection];
+
+   lockScheduler();
+   waiter->state = WAITERIDLE;
+
+   // A grant posted to a child that died before taking it must not carry over
+   sem_destroy(&waiter->granted);
+   sem_init(&waiter->granted, 1, 0);
+   dispatch();
+   pthread_mutex_unlock(&scheduler->lock);
+}
+
+// Chunk hooks, only set while a scheduled send runs
+static void grantBeforeChunk(size_t length) {
+   holdGrant(length);
+}
+
+static void grantAckLate(void) {
+   yieldGrant();
+}
+
+void beginScheduledSend(void) {
+   setChunkHooks(grantBeforeChunk, grantAckLate, SCHEDACKMS);
+}
+
+void holdGrant(size_t bytes) {
+   if (holdingGrant) {
+	return;
+   }
+
+   // Waiting for a grant is the daemon's doing, not the peer's, so no deadline runs
+   beginPhase(PHASEWORK);
+   acquireGrant(currentConnection - connectionTable, currentConnection->client, bytes);
+   beginPhase(PHASEMESSAGE);
+   holdingGrant = true;
+}
+
+void yieldGrant(void) {
+   if (holdingGrant) {
+	releaseGrant(currentConnection - connectionTable);
+	holdingGrant = false;
+   }
+}
+
+void endScheduledSend(void) {
+   setChunkHooks(NULL, NULL, 0);
+   yieldGrant();
+}
@@ -0,0 +1,63 @@
+/*******************************************************************************
+** Description: Fair scheduling of cipher work across daemon children. A
+**              request may name its client with CLIENTTAG (otp_message.h).
+**              Otherwise a remote client is its peer address, and a local
+**              one, which may be any process on the host or otp_router, is
+**              its own connection. Before ciphering each quantum, a child
+**              queues for a grant, and it keeps the grant while it sends
+**              that quantum. A peer that takes longer than SCHEDACKMS to ack
+**              a chunk loses the grant, and the child queues again for the
+**              rest, so a slow reader never holds one. Grants go out
+**              deficit round-robin across clients, weighted per client, with
+**              a cap on each client's bytes in flight. The number of grants
+**              out at once is bounded, so one tenant streaming large messages
+**              cannot hold every CPU while small requests wait behind it. Each
+**              client may also hold only so many connection slots, so it
+**              cannot take the whole table either.
+*******************************************************************************/
+#ifndef OTP_SCHED_H
+#define OTP_SCHED_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "otp_message.h"
+#include "otp_connection.h"
+
+#define SCHEDQUANTUM (64 * MAXSENDSIZE)  // Largest grant, a whole number of message chunks
+#define DEFAULTINFLIGHT (4 * SCHEDQUANTUM)
+#define MAXWEIGHTRULES 16
+#define SCHEDACKMS 20                          // Longest a chunk's ACK may keep a grant waiting
+#define DEFAULTCLIENTSLOTS (MAXCONNECTIONS / 4)
+
+// Map the scheduler before forking.  grants <= 0 means one per online CPU.
+// clientSlots is how many connections one client may have open at once.
+void createScheduler(int grants, size_t inflightCap, int clientSlots);
+
+// Give the client at an IPv4 address or with a client id weight shares of the quantum, 0 on a bad rule
+int addClientWeight(const char* rule);
+
+// Supervisor side, the client a new connection belongs to until its request names one
+uint64_t peerClient(uint32_t address, uint32_t serial);
+
+// Supervisor side, whether a claimed slot's client is under its share of the table, 0 to refuse it
+int admitClient(const struct connectionSlot* slot);
+
+// Child side, take CLIENTTAG and the id off the end of a request and schedule the connection as that client.
+// Ends the connection if the named client already has its share of the table.
+void nameClient(struct otpBuffer* request);
+
+// Child side, wait for a grant of bytes for this connection, then give it back
+void acquireGrant(int connection, uint64_t client, size_t bytes);
+void releaseGrant(int connection);
+
+// Child side, send a message body or checked stream under grants. holdGrant waits for one
+// unless the child still has one, and yieldGrant gives it back between quanta.
+void beginScheduledSend(void);
+void holdGrant(size_t bytes);
+void yieldGrant(void);
+void endScheduledSend(void);
+
+// Supervisor side, drop whatever a dead child was waiting for or holding
+void forgetConnection(int connection);
+
+#endif
@@ -0,0 +1,245 @@
+/*******************************************************************************
+** Description: Transfer spool implementation. Text and key arrive in runs of
+**              CHECKPOINTBYTES. Each run is written to its file before the
+**              checkpoint moves past it. Ciphering works the same way, one
+**              scheduler quantum at a time into the mapped output file. A
+**              child killed at any point therefore leaves a checkpoint that
+**              its files agree with. That guarantee does not cover a host
+**              crash, since nothing is synced. Finished transfers are removed
+**              when the client says "done". Abandoned ones stay until removed
+**              by hand.
+*******************************************************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "otp_spool.h"
+#include "otp_transfer.h"
+#include "otp_message.h"
+#include "otp_buffer.h"
+#include "otp_alphabet.h"
+#include "otp_connection.h"
+#include "otp_sched.h"
+#include "otp_capture.h"
+#include "otp_probes.h"
+#include "otp_keycache.h"
+
+void error(const char *msg);  // Supplied by each program
+
+#define SPOOLMAGIC "OTPXFR2"      // Eight bytes with the terminator
+
+struct transferCheckpoint {
+   char magic[8];
+   int32_t opcode;
+   int32_t alphabet;              // Index in OTP_ALPHABETS
+   uint64_t length;               // Message length, the key is cut to it
+   uint64_t textVerified;         // Bytes in the .text file, all with good checksums
+   uint64_t keyVerified;
+   uint64_t ciphered;             // Bytes of output in the .out file
+   uint64_t textDigest;           // As the client sent them, the files must match once complete
+   uint64_t keyDigest;
+};
+
+static const char* spoolPath = NULL;
+
+void openSpool(const char* path) {
+   struct stat info;
+
+   if (stat(path, &info) < 0) error("ERROR opening spool");
+   if (!S_ISDIR(info.st_mode)) {
+	fprintf(stderr, "Spool %s is not a directory\n", path);
+	exit(1);
+   }
+   spoolPath = path;
+}
+
+// Tell the client why, and end the connection
+static void refuseTransfer(int communicationFD, const char* reason) {
+   fprintf(stderr, "Transfer refused: %s\n", reason);
+   sendMessage(communicationFD, reason, strlen(reason));
+   exit(1);
+}
+
+static void spoolFileName(char* name, size_t size, const char* transferId, const char* suffix) {
+   snprintf(name, size, "%s/%s.%s", spoolPath, transferId, suffix);
+}
+
+static int openSpoolFile(const char* transferId, const char* suffix) {
+   char name[PATH_MAX];
+
+   spoolFileName(name, sizeof(name), transferId, suffix);
+   int fileFD = open(name, O_RDWR | O_CREAT, 0600);
+   if (fileFD < 0) error("ERROR opening spool file");
+   return fileFD;
+}
+
+static void saveCheckpoint(int checkpointFD, const struct transferCheckpoint* checkpoint) {
+   if (pwrite(checkpointFD, checkpoint, sizeof(*checkpoint), 0) != sizeof(*checkpoint)) error("ERROR writing checkpoint");
+}
+
+static void writeAt(int fileFD, const char* data, size_t length, off_t offset) {
+   while (length > 0) {
+	ssize_t written = pwrite(fileFD, data, length, offset);
+	if (written < 0) {
+		if (errno == EINTR) continue;
+		error("ERROR writing spool file");
+	}
+	data += written;
+	length -= written;
+	offset += written;
+   }
+}
+
+// Receive a checked stream into fileFD from *verified on, moving the checkpoint after every run
+static void receiveStream(int communicationFD, int fileFD, uint64_t* verified, int checkpointFD, const struct transferCheckpoint* checkpoint) {
+   struct otpBuffer* run = acquireBuffer(CHECKPOINTBYTES);
+
+   while (*verified < checkpoint->length) {
+	size_t runLength = checkpoint->length - *verified < CHECKPOINTBYTES ? checkpoint->length - *verified : CHECKPOINTBYTES;
+	beginPhase(PHASEMESSAGE);  // The message deadline applies per run, a stream may be any size
+	receiveChecked(communicationFD, run->data, runLength, SERVERACK, SERVERNAK);
+	writeAt(fileFD, run->data, runLength, *verified);
+	*verified += runLength;
+	saveCheckpoint(checkpointFD, checkpoint);
+   }
+   releaseBuffer(run);
+}
+
+// NULL for an empty transfer, which never touches its data
+static char* mapSpoolFile(int fileFD, size_t length, int protection) {
+   if (length == 0) return NULL;
+   char* data = mmap(NULL, length, protection, MAP_SHARED, fileFD, 0);
+   if (data == MAP_FAILED) error("ERROR mapping spool file");
+   return data;
+}
+
+static void removeTransfer(const char* transferId) {
+   static const char* suffixes[] = { "text", "key", "out", "ckpt" };  // Checkpoint last, it holds the lock
+   char name[PATH_MAX];
+
+   for (size_t i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++) {
+	spoolFileName(name, sizeof(name), transferId, suffixes[i]);
+	if (unlink(name) < 0) perror("Unable to remove spool file");
+   }
+}
+
+void serveTransfer(int communicationFD, const char* request, int opcode) {
+   char transferId[MAXTRANSFERID + 1], alphabetName[32];
+   size_t length, outputReceived;
+   uint64_t digestOfText, digestOfKey;
+   const struct alphabet* alphabet;
+   struct transferCheckpoint checkpoint;
+   int connection = currentConnection - connectionTable;
+
+   if (spoolPath == NULL) refuseTransfer(communicationFD, "Resumable transfers are not enabled");
+   if (sscanf(request, TRANSFERPREFIX "%64s %31s %zu %zu %" SCNx64 " %" SCNx64, transferId, alphabetName, &length, &outputReceived,
+              &digestOfText, &digestOfKey) != 6 ||
+       !validTransferId(transferId) || (alphabet = findAlphabet(alphabetName)) == NULL ||
+       outputReceived > length || (outputReceived % CHECKPOINTBYTES != 0 && outputReceived != length)) {
+	refuseTransfer(communicationFD, "Malformed transfer request");
+   }
+
+   int checkpointFD = openSpoolFile(transferId, "ckpt");
+   if (flock(checkpointFD, LOCK_EX | LOCK_NB) < 0) {
+	if (errno != EWOULDBLOCK) error("ERROR locking checkpoint");
+	sendMessage(communicationFD, "busy", 4);
+	exit(0);
+   }
+
+   // A transfer the checkpoint does not describe, contents included, starts over under this id
+   if (pread(checkpointFD, &checkpoint, sizeof(checkpoint), 0) != sizeof(checkpoint) ||
+       memcmp(checkpoint.magic, SPOOLMAGIC, sizeof(checkpoint.magic)) != 0 || checkpoint.opcode != opcode ||
+       checkpoint.alphabet != alphabetIndex(alphabet) || checkpoint.length != length ||
+       checkpoint.textDigest != digestOfText || checkpoint.keyDigest != digestOfKey) {
+	memset(&checkpoint, 0, sizeof(checkpoint));
+	memcpy(checkpoint.magic, SPOOLMAGIC, sizeof(checkpoint.magic));
+	checkpoint.opcode = opcode;
+	checkpoint.alphabet = alphabetIndex(alphabet);
+	checkpoint.length = length;
+	checkpoint.textDigest = digestOfText;
+	checkpoint.keyDigest = digestOfKey;
+   }
+   if (outputReceived > checkpoint.ciphered) {
+	refuseTransfer(communicationFD, "Client holds output this transfer never produced");
+   }
+
+   int textFD = openSpoolFile(transferId, "text");
+   int keyFD = openSpoolFile(transferId, "key");
+   int outputFD = openSpoolFile(transferId, "out");
+   if (ftruncate(textFD, checkpoint.textVerified) < 0 || ftruncate(keyFD, checkpoint.keyVerified) < 0 ||
+       ftruncate(outputFD, checkpoint.ciphered) < 0) {
+	error("ERROR trimming spool files");
+   }
+   saveCheckpoint(checkpointFD, &checkpoint);
+
+   char reply[48];
+   int replyLength = snprintf(reply, sizeof(reply), "%" PRIu64 " %" PRIu64, checkpoint.textVerified, checkpoint.keyVerified);
+   sendMessage(communicationFD, reply, replyLength);
+   captureRequest(opcode, alphabet, length);
+   captureKey(digestOfKey, length, 0);  // Only the key bytes in use cross, and are never cached
+   captureTransfer();
+
+   receiveStream(communicationFD, textFD, &checkpoint.textVerified, checkpointFD, &checkpoint);
+   receiveStream(communicationFD, keyFD, &checkpoint.keyVerified, checkpointFD, &checkpoint);
+   beginPhase(PHASEIDLE);
+
+   if (ftruncate(outputFD, length) < 0) error("ERROR sizing spool file");
+   const char* text = mapSpoolFile(textFD, length, PROT_READ);
+   const char* key = mapSpoolFile(keyFD, length, PROT_READ);
+   char* output = mapSpoolFile(outputFD, length, PROT_READ | PROT_WRITE);
+   cipherKernel kernel = opcode == CAPTUREENCRYPT ? alphabet->encode : alphabet->decode;
+
+   // What was ciphered before was validated and matched its digests before
+   size_t remaining = length - checkpoint.ciphered;
+   if (remaining > 0 && (keyDigest(text, length) != digestOfText || keyDigest(key, length) != digestOfKey)) {
+	removeTransfer(transferId);
+	refuseTransfer(communicationFD, "Text or key does not match its digest");
+   }
+   if (remaining > 0 && (alphabet->validate(text + checkpoint.ciphered, remaining) != remaining ||
+                         alphabet->validate(key + checkpoint.ciphered, remaining) != remaining)) {
+	char reason[64];
+	snprintf(reason, sizeof(reason), "Invalid character(s) for alphabet %s", alphabet->name);
+	removeTransfer(transferId);
+	refuseTransfer(communicationFD, reason);
+   }
+   sendMessage(communicationFD, "ok", 2);
+
+   // Waiting for a grant is the daemon's doing, not the peer's, so no deadline runs
+   beginPhase(PHASEWORK);
+   while (checkpoint.ciphered < length) {
+	size_t quantum = length - checkpoint.ciphered < SCHEDQUANTUM ? length - checkpoint.ciphered : SCHEDQUANTUM;
+	acquireGrant(connection, currentConnection->client, quantum);
+	OTP_PROBE3(cipher_start, currentSerial, checkpoint.ciphered, quantum);
+	kernel(output + checkpoint.ciphered, text + checkpoint.ciphered, key + checkpoint.ciphered, quantum);
+	OTP_PROBE3(cipher_end, currentSerial, checkpoint.ciphered, quantum);
+	releaseGrant(connection);
+	checkpoint.ciphered += quantum;
+	saveCheckpoint(checkpointFD, &checkpoint);
+   }
+
+   // Send the output the client is missing, in runs that line up with its checkpoints, a grant per run
+   beginPhase(PHASEMESSAGE);
+   beginScheduledSend();
+   for (size_t offset = outputReceived; offset < length; offset += CHECKPOINTBYTES) {
+	size_t runLength = length - offset < CHECKPOINTBYTES ? length - offset : CHECKPOINTBYTES;
+	holdGrant(runLength);
+	sendChecked(communicationFD, output + offset, runLength);
+	yieldGrant();
+   }
+   endScheduledSend();
+   beginPhase(PHASEIDLE);
+
+   struct otpBuffer* done = receiveMessage(communicationFD, SERVERACK);
+   if (strcmp(done->data, "done") == 0) removeTransfer(transferId);
+   releaseBuffer(done);
+   OTP_PROBE3(request_done, currentSerial, opcode, length);
+}
@@ -0,0 +1,20 @@
+/*******************************************************************************
+** Description: Daemon side of resumable transfers (otp_transfer.h). Each
+**              transfer keeps four files in the spool directory:
+**              <id>.ckpt, <id>.text, <id>.key and <id>.out. The checkpoint
+**              is the record of truth. When a transfer resumes, each data
+**              file is cut back to what the checkpoint vouches for. While a
+**              connection serves a transfer it holds a lock on the
+**              checkpoint. A client that reconnects before its old
+**              connection is noticed as dead is told "busy", and retries.
+*******************************************************************************/
+#ifndef OTP_SPOOL_H
+#define OTP_SPOOL_H
+
+// Keep resumable transfers under path, which must already exist
+void openSpool(const char* path);
+
+// Serve a transfer request to the end.  opcode is CAPTUREENCRYPT or CAPTUREDECRYPT.
+void serveTransfer(int communicationFD, const char* request, int opcode);
+
+#endif
@@ -0,0 +1,112 @@
+/*******************************************************************************
+** Description: Timer wheel implementation. A timer goes into the lowest level
+**              whose span covers its distance from the current tick. When
+**              level 0 wraps, the next slot of level 1 is emptied back into
+**              the wheel, and so on up the levels.
+*******************************************************************************/
+#include <stddef.h>
+#include "otp_timer.h"
+
+static void initList(struct timer* head) {
+   head->next = head;
+   head->prev = head;
+}
+
+void initTimerWheel(struct timerWheel* wheel, uint64_t nowTick) {
+   wheel->currentTick = nowTick;
+   for (int level = 0; level < WHEELLEVELS; level++) {
+	for (int slot = 0; slot < WHEELSIZE; slot++) {
+		initList(&wheel->slots[level][slot]);
+	}
+   }
+}
+
+// Link a timer into the slot matching its expiry
+static void placeTimer(struct timerWheel* wheel, struct timer* timer) {
+   uint64_t delta = timer->expires - wheel->currentTick;
+   int level = 0;
+
+   while (level < WHEELLEVELS - 1 && delta >= ((uint64_t)1 << (WHEELBITS * (level + 1)))) {
+	level++;
+   }
+
+   // Past the top level's span, park it in the furthest slot and let cascading catch up
+   uint64_t expires = timer->expires;
+   if (delta >= ((uint64_t)1 << (WHEELBITS * WHEELLEVELS))) {
+	expires = wheel->currentTick + ((uint64_t)1 << (WHEELBITS * WHEELLEVELS)) - 1;
+   }
+
+   struct timer* head = &wheel->slots[level][(expires >> (WHEELBITS * level)) & (WHEELSIZE - 1)];
+   timer->next = head;
+   timer->prev = head->prev;
+   head->prev->next = timer;
+   head->prev = timer;
+}
+
+void addTimer(struct timerWheel* wheel, struct timer* timer, uint64_t expires) {
+   cancelTimer(timer);
+   if (expires <= wheel->currentTick) {
+	expires = wheel->currentTick + 1;
+   }
+   timer->expires = expires;
+   placeTimer(wheel, timer);
+}
+
+void cancelTimer(struct timer* timer) {
+   if (timer->next == NULL) {
+	return;
+   }
+   timer->prev->next = timer->next;
+   timer->next->prev = timer->prev;
+   timer->next = NULL;
+   timer->prev = NULL;
+}
+
+bool timerArmed(const struct timer* timer) {
+   return timer->next != NULL;
+}
+
+// Move every timer in a higher level slot down to where it now belongs
+static void cascade(struct timerWheel* wheel, int level) {
+   struct timer* head = &wheel->slots[level][(wheel->currentTick >> (WHEELBITS * level)) & (WHEELSIZE - 1)];
+   struct timer* timer = head->next;
+
+   initList(head);
+   while (timer != head) {
+	struct timer* next = timer->next;
+	placeTimer(wheel, timer);
+	timer = next;
+   }
+}
+
+void advanceTimerWheel(struct timerWheel* wheel, uint64_t nowTick) {
+   while (wheel->currentTick < nowTick) {
+	wheel->currentTick++;
+
+	// Refill lower levels each time the one below wraps
+	for (int level = 1; level < WHEELLEVELS; level++) {
+		if ((wheel->currentTick & (((uint64_t)1 << (WHEELBITS * level)) - 1)) != 0) {
+			break;
+		}
+		cascade(wheel, level);
+	}
+
+	// Detach the due slot first so callbacks can re-arm freely
+	struct timer due;
+	struct timer* head = &wheel->slots[0][wheel->currentTick & (WHEELSIZE - 1)];
+	if (head->next == head) {
+		continue;
+	}
+	due.next = head->next;
+	due.prev = head->prev;
+	due.next->prev = &due;
+	due.prev->next = &due;
+	initList(head);
+
+	while (due.next != &due) {
+		struct timer* timer = due.next;
+		cancelTimer(timer);
+		timer->callback(timer);
+	}
+   }
+}
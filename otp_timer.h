@@ -0,0 +1,43 @@
+/*******************************************************************************
+** Description: Hierarchical timer wheel. WHEELLEVELS wheels of WHEELSIZE
+**              slots each, where a slot at level n spans WHEELSIZE^n ticks.
+**              A timer lives in an intrusive list, so adding and cancelling
+**              are O(1). Each tick runs one level-0 slot, and timers cascade
+**              down a level only when the wheel below wraps.
+*******************************************************************************/
+#ifndef OTP_TIMER_H
+#define OTP_TIMER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define WHEELBITS 6
+#define WHEELSIZE (1 << WHEELBITS)
+#define WHEELLEVELS 4  // 64^4 ticks, about 19 days at 100 ms a tick
+
+struct timer {
+   struct timer* next;
+   struct timer* prev;
+   uint64_t expires;                      // Absolute tick
+   void (*callback)(struct timer* timer);
+};
+
+struct timerWheel {
+   uint64_t currentTick;
+   struct timer slots[WHEELLEVELS][WHEELSIZE];  // List heads
+};
+
+void initTimerWheel(struct timerWheel* wheel, uint64_t nowTick);
+
+// Arm timer to fire at tick expires, no earlier than the next tick
+void addTimer(struct timerWheel* wheel, struct timer* timer, uint64_t expires);
+
+// Disarm a timer, harmless if it is not armed
+void cancelTimer(struct timer* timer);
+
+bool timerArmed(const struct timer* timer);
+
+// Run every timer due up to and including nowTick
+void advanceTimerWheel(struct timerWheel* wheel, uint64_t nowTick);
+
+#endif
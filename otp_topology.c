@@ -0,0 +1,168 @@
+/*******************************************************************************
+** Description: CPU placement implementation. sysfs supplies each CPU's
+**              package, core id, and node. A CPU whose files are missing is
+**              treated as its own core on node 0. Placement runs in the
+**              supervisor, which keeps the turn counters and the count of
+**              children running on each CPU. The child only applies the
+**              result.
+*******************************************************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <sched.h>
+#include <dirent.h>
+#include "otp_topology.h"
+
+void error(const char *msg);  // Supplied by each program
+
+struct cpuPlace {
+   int core;                      // Package and core id together, unique per physical core
+   int node;
+   bool accept;                   // Reserved for the accept path
+   bool allowed;                  // In the supervisor's affinity mask
+   int running;                   // Children placed here and not yet reaped
+};
+
+static struct cpuPlace cpus[CPU_SETSIZE];
+static int workers[CPU_SETSIZE];
+static int numWorkers = 0;
+static cpu_set_t acceptSet;
+
+static int readTopology(int cpu, const char* name, int fallback) {
+   char path[128];
+   int value;
+
+   snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, name);
+   FILE* file = fopen(path, "r");
+   if (file == NULL) return fallback;
+   if (fscanf(file, "%d", &value) != 1) value = fallback;
+   fclose(file);
+   return value;
+}
+
+// The CPU's directory holds a nodeN link for the node it belongs to
+static int nodeOf(int cpu) {
+   char path[64];
+   struct dirent* entry;
+   int node = 0;
+
+   snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+   DIR* directory = opendir(path);
+   if (directory == NULL) return 0;
+   while ((entry = readdir(directory)) != NULL) {
+	if (sscanf(entry->d_name, "node%d", &node) == 1) break;
+   }
+   closedir(directory);
+   return node;
+}
+
+int discoverTopology(int acceptCores) {
+   cpu_set_t allowed;
+   int reservedCores[CPU_SETSIZE];
+   int numReserved = 0;
+
+   if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) error("ERROR reading CPU affinity");
+   CPU_ZERO(&acceptSet);
+
+   for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+	if (!CPU_ISSET(cpu, &allowed)) continue;
+	cpus[cpu].allowed = true;
+	cpus[cpu].core = readTopology(cpu, "physical_package_id", 0) * 65536 + readTopology(cpu, "core_id", cpu);
+	cpus[cpu].node = nodeOf(cpu);
+
+	// Reserve whole cores, in the order they are first seen
+	bool reserved = false;
+	for (int i = 0; i < numReserved; i++) {
+		if (reservedCores[i] == cpus[cpu].core) reserved = true;
+	}
+	if (!reserved && numReserved < acceptCores) {
+		reservedCores[numReserved++] = cpus[cpu].core;
+		reserved = true;
+	}
+
+	cpus[cpu].accept = reserved;
+	if (reserved) CPU_SET(cpu, &acceptSet);
+	else workers[numWorkers++] = cpu;
+   }
+   return numWorkers;
+}
+
+void pinAcceptPath(void) {
+   if (CPU_COUNT(&acceptSet) > 0 && sched_setaffinity(0, sizeof(acceptSet), &acceptSet) < 0) {
+	perror("Unable to pin the accept path");
+   }
+}
+
+// Next idle worker in turn that passes match, or -1
+static int nextIdleWorker(int* turn, int incomingCpu, bool (*match)(int worker, int incomingCpu)) {
+   for (int n = 0; n < numWorkers; n++) {
+	int worker = workers[(*turn + n) % numWorkers];
+	if (cpus[worker].running == 0 && match(worker, incomingCpu)) {
+		*turn = (*turn + n + 1) % numWorkers;
+		return worker;
+	}
+   }
+   return -1;
+}
+
+static bool sameCore(int worker, int incomingCpu) {
+   return cpus[worker].core == cpus[incomingCpu].core;
+}
+
+static bool sameNode(int worker, int incomingCpu) {
+   return cpus[worker].node == cpus[incomingCpu].node;
+}
+
+static bool anyWorker(int worker, int incomingCpu) {
+   (void)worker;
+   (void)incomingCpu;
+   return true;
+}
+
+// Every worker is busy: the one with the fewest children, on incomingCpu's node if it ties
+static int leastLoadedWorker(int* turn, int incomingCpu) {
+   int best = -1;
+
+   for (int n = 0; n < numWorkers; n++) {
+	int worker = workers[(*turn + n) % numWorkers];
+	if (best < 0 || cpus[worker].running < cpus[best].running ||
+	    (cpus[worker].running == cpus[best].running && incomingCpu >= 0 &&
+	     sameNode(worker, incomingCpu) && !sameNode(best, incomingCpu))) {
+		best = worker;
+	}
+   }
+   *turn = (*turn + 1) % numWorkers;
+   return best;
+}
+
+int placeConnection(int incomingCpu) {
+   static int coreTurn = 0, nodeTurn = 0, anyTurn = 0;
+   int worker = -1;
+
+   if (incomingCpu < 0 || incomingCpu >= CPU_SETSIZE || !cpus[incomingCpu].allowed) incomingCpu = -1;
+
+   // The CPU that took the packets if it is free, else the nearest idle worker
+   if (incomingCpu >= 0) {
+	if (!cpus[incomingCpu].accept && cpus[incomingCpu].running == 0) worker = incomingCpu;
+	if (worker < 0) worker = nextIdleWorker(&coreTurn, incomingCpu, sameCore);
+	if (worker < 0) worker = nextIdleWorker(&nodeTurn, incomingCpu, sameNode);
+   }
+   if (worker < 0) worker = nextIdleWorker(&anyTurn, incomingCpu, anyWorker);
+   if (worker < 0) worker = leastLoadedWorker(&anyTurn, incomingCpu);
+
+   cpus[worker].running++;
+   return worker;
+}
+
+void releaseConnection(int cpu) {
+   if (cpu >= 0) cpus[cpu].running--;
+}
+
+void pinToCpu(int cpu) {
+   cpu_set_t only;
+
+   CPU_ZERO(&only);
+   CPU_SET(cpu, &only);
+   if (sched_setaffinity(0, sizeof(only), &only) < 0) perror("Unable to pin connection");
+}
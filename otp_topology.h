@@ -0,0 +1,37 @@
+/*******************************************************************************
+** Description: CPU placement for the daemons (-A). At startup the supervisor
+**              reads which CPUs it may run on, and each one's physical core
+**              and NUMA node from sysfs. The first n physical cores, with all
+**              their hardware threads, are kept for the supervisor's accept
+**              path. The remaining CPUs serve connections. Each connection's
+**              child pins itself to the worker CPU that processed the
+**              connection's packets, as long as no other child runs there.
+**              Otherwise it spills to an idle worker CPU on the same core,
+**              then the same node, then anywhere. Only when every worker CPU
+**              has a child does it share one, the least loaded, preferring
+**              its node. Loopback connections, whose packets all land on one
+**              CPU, therefore still spread out. The child pins itself before
+**              it allocates anything, so the kernel's first-touch policy puts
+**              its buffers, and its copies of the supervisor's pages, on the
+**              local node.
+*******************************************************************************/
+#ifndef OTP_TOPOLOGY_H
+#define OTP_TOPOLOGY_H
+
+// Read the topology and reserve acceptCores physical cores. Returns how many CPUs are left for connections.
+int discoverTopology(int acceptCores);
+
+// Supervisor: run only on the reserved cores, if any were reserved
+void pinAcceptPath(void);
+
+// Worker CPU for a connection whose packets arrived on incomingCpu, which may be -1.
+// The CPU counts the connection as running until releaseConnection.
+int placeConnection(int incomingCpu);
+
+// Supervisor, on reaping a child placed on cpu, -1 for one never placed
+void releaseConnection(int cpu);
+
+// Child side: run only on cpu from here on
+void pinToCpu(int cpu);
+
+#endif
@@ -0,0 +1,134 @@
+/*******************************************************************************
+** Description: Resumable transfer client. A dropped connection ends the
+**              process that was using it, since the message layer exits on a
+**              closed socket. Each attempt therefore runs in a forked child.
+**              Output that arrives verified is copied into a shared mapping,
+**              and the parent starts the next attempt from there. A client
+**              that gives up can be run again with the same id, and the
+**              daemon's checkpoint still spares it the upload.
+*******************************************************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "otp_transfer.h"
+#include "otp_keycache.h"
+
+void error(const char *msg);  // Supplied by each program
+
+#define TRANSFERRUNNING 0
+#define TRANSFERDONE 1
+#define TRANSFERREFUSED 2         // The daemon said no, trying again will not help
+
+// Shared with every attempt, the output follows it
+struct transferProgress {
+   volatile size_t received;      // Verified output bytes, always a whole number of runs
+   volatile int state;
+   uint64_t textDigest;           // Set once before the first attempt
+   uint64_t keyDigest;
+};
+
+bool isTransferRequest(const char* message) {
+   return strncmp(message, TRANSFERPREFIX, strlen(TRANSFERPREFIX)) == 0;
+}
+
+bool validTransferId(const char* transferId) {
+   size_t length = strlen(transferId);
+   if (length == 0 || length > MAXTRANSFERID) return false;
+
+   for (size_t i = 0; i < length; i++) {
+	if (!isalnum((unsigned char)transferId[i]) && transferId[i] != '-' && transferId[i] != '_') return false;
+   }
+   return true;
+}
+
+// One attempt, in its own process
+static void attemptTransfer(const char* transferId, const struct alphabet* alphabet, const struct otpBuffer* text, const struct otpBuffer* key,
+                            const char* clientId, int portNumber, int (*openConnection)(int portNumber), struct transferProgress* progress) {
+   char request[320];
+   char* output = (char*)(progress + 1);
+   size_t length = text->length, textVerified, keyVerified;
+
+   int socketFD = openConnection(portNumber);
+   int requestLength = snprintf(request, sizeof(request), TRANSFERPREFIX "%s %s %zu %zu %016" PRIx64 " %016" PRIx64 "%s%s", transferId, alphabet->name,
+                                length, progress->received, progress->textDigest, progress->keyDigest,
+                                clientId != NULL ? CLIENTTAG : "", clientId != NULL ? clientId : "");
+   sendMessage(socketFD, request, requestLength);
+
+   // Another connection still holds the transfer, most likely our own dropped one
+   struct otpBuffer* reply = receiveMessage(socketFD, CLIENTACK);
+   if (strcmp(reply->data, "busy") == 0) exit(0);
+   if (sscanf(reply->data, "%zu %zu", &textVerified, &keyVerified) != 2 || textVerified > length || keyVerified > length) {
+	fprintf(stderr, "Transfer %s refused: %s\n", transferId, reply->data);
+	progress->state = TRANSFERREFUSED;
+	exit(0);
+   }
+   releaseBuffer(reply);
+
+   sendChecked(socketFD, text->data + textVerified, length - textVerified);
+   sendChecked(socketFD, key->data + keyVerified, length - keyVerified);
+
+   reply = receiveMessage(socketFD, CLIENTACK);
+   if (strcmp(reply->data, "ok") != 0) {
+	fprintf(stderr, "Transfer %s refused: %s\n", transferId, reply->data);
+	progress->state = TRANSFERREFUSED;
+	exit(0);
+   }
+   releaseBuffer(reply);
+
+   // Record progress a run at a time, the daemon resends from a run boundary
+   while (progress->received < length) {
+	size_t runLength = length - progress->received < CHECKPOINTBYTES ? length - progress->received : CHECKPOINTBYTES;
+	receiveChecked(socketFD, output + progress->received, runLength, CLIENTACK, CLIENTNAK);
+	progress->received += runLength;
+   }
+
+   sendMessage(socketFD, "done", 4);
+   progress->state = TRANSFERDONE;
+   close(socketFD);
+}
+
+void runTransfer(const char* transferId, const struct alphabet* alphabet, const struct otpBuffer* text, const struct otpBuffer* key,
+                 const char* clientId, int portNumber, int (*openConnection)(int portNumber)) {
+   struct transferProgress* progress;
+   size_t mappingSize = sizeof(*progress) + text->length;
+
+   progress = mmap(NULL, mappingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+   if (progress == MAP_FAILED) error("CLIENT: ERROR mapping transfer");
+   progress->received = 0;
+   progress->state = TRANSFERRUNNING;
+   progress->textDigest = keyDigest(text->data, text->length);
+   progress->keyDigest = keyDigest(key->data, text->length);
+
+   for (int attempt = 1; progress->state == TRANSFERRUNNING; attempt++) {
+	if (attempt > 1) {
+		if (attempt > MAXTRANSFERATTEMPTS) break;
+		sleep(1 << (attempt - 2));  // Back off before reconnecting
+	}
+
+	pid_t pid = fork();
+	if (pid < 0) error("CLIENT: ERROR forking");
+	if (pid == 0) {
+		attemptTransfer(transferId, alphabet, text, key, clientId, portNumber, openConnection, progress);
+		exit(0);
+	}
+	if (waitpid(pid, NULL, 0) < 0) error("CLIENT: ERROR waiting for transfer");
+   }
+
+   if (progress->state != TRANSFERDONE) {
+	if (progress->state == TRANSFERRUNNING) {
+		fprintf(stderr, "Transfer %s did not finish, run again with -r %s to resume\n", transferId, transferId);
+	}
+	exit(1);
+   }
+
+   fwrite((char*)(progress + 1), 1, text->length, stdout);
+   printf("\n");
+   munmap(progress, mappingSize);
+}
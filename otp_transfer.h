@@ -0,0 +1,52 @@
+/*******************************************************************************
+** Description: Resumable transfers, -r on the clients and -S on the daemons.
+**              The client names a transfer with an id of its choosing. The
+**              daemon keeps the text and key it receives under that id in its
+**              spool directory. A checkpoint records how many bytes of each
+**              arrived with good checksums, and how many have been ciphered.
+**              When a connection drops, the client reconnects, the daemon
+**              answers with its checkpoint, and only the missing bytes cross
+**              the network again. That includes output the client already
+**              holds. All streams are checked streams (otp_message.h).
+**
+**              The exchange after the token:
+**                 client  "transfer <id> <alphabet> <length> <outputReceived>
+**                         <textDigest> <keyDigest>", with CLIENTTAG and a
+**                         client id after it if one is named
+**                 daemon  "<textVerified> <keyVerified>", "busy", or a reason
+**                 client  text from textVerified, then key from keyVerified
+**                 daemon  "ok" once all is verified, or a reason
+**                 daemon  output from outputReceived
+**                 client  "done", and the daemon removes the transfer
+**
+**              Only the first length bytes of the key are sent, since the
+**              rest is never used. The digests are XXH64 of the whole text
+**              and of those key bytes, in hex. They tie the id to its
+**              contents. A request with other contents under the same id
+**              starts the transfer over, so it never receives output of a
+**              different text or key.
+*******************************************************************************/
+#ifndef OTP_TRANSFER_H
+#define OTP_TRANSFER_H
+
+#include <stdbool.h>
+#include "otp_buffer.h"
+#include "otp_alphabet.h"
+#include "otp_message.h"
+
+#define TRANSFERPREFIX "transfer "           // No alphabet name has a space
+#define MAXTRANSFERID 64
+#define CHECKPOINTBYTES (64 * MAXSENDSIZE)   // Bytes per checkpoint, whole chunks
+#define MAXTRANSFERATTEMPTS 5
+
+// First message of a request asks for a resumable transfer
+bool isTransferRequest(const char* message);
+
+// 1 to MAXTRANSFERID letters, digits, '-' or '_', so it is safe as a file name
+bool validTransferId(const char* transferId);
+
+// Client side: run the transfer to the end, reconnecting through openConnection after a drop, and print the output
+void runTransfer(const char* transferId, const struct alphabet* alphabet, const struct otpBuffer* text, const struct otpBuffer* key,
+                 const char* clientId, int portNumber, int (*openConnection)(int portNumber));
+
+#endif